@@ -49,9 +49,23 @@ public:
         }
     }
 
-    // Get the cumulative frequence for the next symbol
+    // Get the cumulative frequence for the next symbol. It is
+    // clamped below total so that corrupt input cannot break the
+    // invariants of m_low and m_high.
     code_value get_cum_freq(code_value total) {
-        return ((m_value-m_low+1)*total - 1) / (m_high-m_low+1);
+        if (m_value < m_low)
+            return 0;
+        code_value cum = ((m_value-m_low+1)*total - 1) / (m_high-m_low+1);
+        return cum < total ? cum : total-1;
+    }
+
+    // Bytes read past the end of the encoder's output, once the
+    // last symbol is popped. The code value is Code_value_bits
+    // ahead of the bits popped, and finish_encoding wrote only
+    // the first two of them, then always one more byte, with the
+    // bits of the last one left if any.
+    int read_ahead() const {
+        return (Code_value_bits-3 + m_bits_to_go) / 8;
     }
 
     // Remove the symbol represented by low, high and total
@@ -119,6 +119,7 @@ public:
             bit_plus_follow(1);
         }
         flush();
+        m_writer.flush();
     }
 };
 
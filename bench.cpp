@@ -0,0 +1,400 @@
+//====================================================================
+// Benchmark of the PPM model on synthetic corpora.
+//
+//   python setup.py build_bench
+//   ./bench [-s bytes] [-r repeats] [-t threads] [-o order,...] [corpus...]
+//
+// The corpora are generated from fixed seeds, so every build sees
+// the same bytes: text, binary, repetitive and random, all of them
+// by default. -o takes a list of model orders, such as 2,4,6, and
+// every corpus runs at each of them. Each corpus and order runs in a
+// process of its own, so the peak RSS is its own too.
+//
+// Every result is a line of JSON on stdout, one for each corpus and
+// order, the time of a step is the best of the repeats:
+//
+//   corpus, bytes, order         The input and the model order
+//   coders[]                     For each coder, with exclusion off
+//                                and on: coder, exclusion,
+//                                encode_mbps, decode_mbps,
+//                                coded_bytes, bits_per_byte and
+//                                roundtrip, the decoder output
+//                                checked against the input
+//   threads, train_mbps, score_mbps
+//                                Training on the first half and
+//                                scoring the second
+//   contexts[], bytes_per_context, memory, index_memory, peak_rss_kb
+//                                The model trained on all the input,
+//                                contexts of each order
+//====================================================================
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "ppm_model.h"
+#include "io_adapter.h"
+
+using namespace std;
+
+// A xorshift generator, the same on every platform
+class Random
+{
+private:
+    unsigned m_state;
+
+public:
+    Random(unsigned seed)
+        :m_state(seed) {
+    }
+
+    unsigned next() {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 17;
+        m_state ^= m_state << 5;
+        return m_state;
+    }
+
+    // In [0, n)
+    unsigned below(unsigned n) {
+        return next() % n;
+    }
+};
+
+// Words of Zipf-like frequencies in sentences and lines
+static void make_text(vector<unsigned char> &out, size_t size)
+{
+    static const char *syllables[] = {
+        "the", "an", "or", "in", "to", "re", "con", "pre", "ing", "ed",
+        "tion", "al", "er", "ly", "st", "ou", "ch", "th", "ar", "ment"
+    };
+    Random r(1);
+    vector<string> words;
+    for (int i = 0; i < 2000; ++i) {
+        string w;
+        for (int n = 1 + r.below(3); n > 0; --n)
+            w += syllables[r.below(sizeof(syllables)/sizeof(syllables[0]))];
+        words.push_back(w);
+    }
+
+    bool capital = true;
+    int line = 0;
+    while (out.size() < size) {
+        // The rank is roughly 1/x distributed
+        unsigned rank = (unsigned)(words.size() / (1.0 + r.below(1000) / 2.0)) - 1;
+        string w = words[rank < words.size() ? rank : 0];
+        if (capital)
+            w[0] = w[0] - 'a' + 'A';
+        capital = false;
+        out.insert(out.end(), w.begin(), w.end());
+        line += w.size();
+
+        unsigned p = r.below(100);
+        if (p < 8) {
+            out.push_back('.');
+            capital = true;
+        } else if (p < 14) {
+            out.push_back(',');
+        }
+        if (line > 70) {
+            out.push_back('\n');
+            line = 0;
+        } else {
+            out.push_back(' ');
+            ++line;
+        }
+    }
+    out.resize(size);
+}
+
+// Fixed-size records: a counter, a small enum, a slowly drifting
+// little-endian value, a float and some padding
+static void make_binary(vector<unsigned char> &out, size_t size)
+{
+    Random r(2);
+    unsigned counter = 0;
+    int value = 100000;
+    while (out.size() < size) {
+        unsigned char rec[24];
+        memset(rec, 0, sizeof(rec));
+        for (int i = 0; i < 4; ++i)
+            rec[i] = (counter >> (8*i)) & 0xFF;
+        rec[4] = r.below(5);
+        value += (int)r.below(201) - 100;
+        for (int i = 0; i < 4; ++i)
+            rec[8+i] = ((unsigned)value >> (8*i)) & 0xFF;
+        float f = value / 1000.0f;
+        memcpy(rec+12, &f, 4);
+        rec[16] = r.below(256);
+        out.insert(out.end(), rec, rec+sizeof(rec));
+        ++counter;
+    }
+    out.resize(size);
+}
+
+// A few blocks repeated over and over with rare changes
+static void make_repetitive(vector<unsigned char> &out, size_t size)
+{
+    Random r(3);
+    vector<unsigned char> blocks[4];
+    for (int b = 0; b < 4; ++b)
+        for (int i = 0; i < 200 + 100*b; ++i)
+            blocks[b].push_back('a' + r.below(26));
+    while (out.size() < size) {
+        const vector<unsigned char> &b = blocks[r.below(4)];
+        size_t start = out.size();
+        out.insert(out.end(), b.begin(), b.end());
+        if (r.below(4) == 0)
+            out[start + r.below(b.size())] = 'A' + r.below(26);
+    }
+    out.resize(size);
+}
+
+static void make_random(vector<unsigned char> &out, size_t size)
+{
+    Random r(4);
+    out.resize(size);
+    for (size_t i = 0; i < size; ++i)
+        out[i] = r.next() >> 24;
+}
+
+struct Corpus
+{
+    const char *name;
+    void (*make)(vector<unsigned char> &, size_t);
+};
+
+static const Corpus corpora[] = {
+    { "text", make_text },
+    { "binary", make_binary },
+    { "repetitive", make_repetitive },
+    { "random", make_random },
+};
+static const int No_of_corpora = sizeof(corpora)/sizeof(corpora[0]);
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+static double mbps(size_t bytes, double seconds)
+{
+    return seconds > 0 ? bytes/1e6/seconds : 0;
+}
+
+// Return false if the decoder output is not the input
+template<typename Coder>
+static bool bench_coder(const char *name, int order, bool exclusion,
+                        const vector<unsigned char> &data, int repeats)
+{
+    double best_enc = 0, best_dec = 0;
+    size_t coded = 0;
+    bool ok = true;
+
+    for (int r = 0; r < repeats; ++r) {
+        MemoryOutputAdapter out;
+        PPMModel *model = new PPMModel(Coder::max_frequency, order);
+        model->m_contexts.set_exclusion(exclusion);
+        double t0 = now();
+        {
+            PPMEncoder<MemoryOutputAdapter, DefaultContextUpdater, Coder> penc(out, model);
+            penc.start_encoding();
+            penc.encode(&data[0], data.size());
+            penc.finish_encoding();
+        }
+        double t1 = now();
+        model->decref();
+        coded = out.size();
+
+        MemoryInputAdapter in(out.data(), out.size());
+        size_t n = 0;
+        model = new PPMModel(Coder::max_frequency, order);
+        model->m_contexts.set_exclusion(exclusion);
+        double t2 = now();
+        {
+            PPMDecoder<MemoryInputAdapter, DefaultContextUpdater, Coder> pdec(in, model);
+            pdec.start_decoding();
+            for (;;) {
+                wsymbol_t sym = pdec.decode();
+                if (sym == EOF_symbol)
+                    break;
+                if (n == data.size() || sym != data[n]) {
+                    ok = false;
+                    break;
+                }
+                ++n;
+            }
+            pdec.finish_decoding();
+        }
+        double t3 = now();
+        model->decref();
+        ok = ok && n == data.size();
+
+        if (r == 0 || t1-t0 < best_enc)
+            best_enc = t1-t0;
+        if (r == 0 || t3-t2 < best_dec)
+            best_dec = t3-t2;
+    }
+
+    printf("\"coder\": \"%s\", \"exclusion\": %s, \"encode_mbps\": %.3f, "
+           "\"decode_mbps\": %.3f, \"coded_bytes\": %lu, \"bits_per_byte\": %.4f, "
+           "\"roundtrip\": %s",
+           name, exclusion ? "true" : "false", mbps(data.size(), best_enc), mbps(data.size(), best_dec),
+           (unsigned long)coded, 8.0*coded/data.size(), ok ? "true" : "false");
+    return ok;
+}
+
+static bool bench_corpus(const Corpus &corpus, size_t size, int repeats, int threads,
+                         int order)
+{
+    vector<unsigned char> data;
+    corpus.make(data, size);
+
+    printf("{\"corpus\": \"%s\", \"bytes\": %lu, \"order\": %d, ",
+           corpus.name, (unsigned long)data.size(), order);
+    printf("\"coders\": [");
+    bool ok = true;
+    for (int exclusion = 0; exclusion <= 1; ++exclusion) {
+        printf(exclusion ? ", {" : "{");
+        ok = bench_coder<ArithmeticCoder>("arithmetic", order, exclusion, data, repeats) && ok;
+        printf("}, {");
+        ok = bench_coder<RangeCoder>("range", order, exclusion, data, repeats) && ok;
+        printf("}");
+    }
+    printf("], ");
+
+    // Train on the first half, score the second
+    size_t half = data.size()/2;
+    double best_train = 0, best_score = 0;
+    for (int r = 0; r < repeats; ++r) {
+        PPMModel *model = new PPMModel(Max_frequency, order);
+        double t0 = now();
+        ppm_train(model, &data[0], half, threads);
+        double t1 = now();
+        {
+            NullOutputAdapter nad;
+            PPMScorer<NullOutputAdapter> penc(nad, model);
+            penc.start_encoding();
+            penc.encode(&data[half], data.size()-half);
+            penc.finish_encoding();
+        }
+        double t2 = now();
+        model->decref();
+
+        if (r == 0 || t1-t0 < best_train)
+            best_train = t1-t0;
+        if (r == 0 || t2-t1 < best_score)
+            best_score = t2-t1;
+    }
+    printf("\"threads\": %d, \"train_mbps\": %.3f, \"score_mbps\": %.3f, ",
+           threads, mbps(half, best_train), mbps(data.size()-half, best_score));
+
+    PPMModel *model = new PPMModel(Max_frequency, order);
+    ppm_train(model, &data[0], data.size());
+    TrieCensus census;
+    model->m_contexts.census(census);
+    printf("\"contexts\": [");
+    for (int i = 0; i <= order; ++i)
+        printf(i == 0 ? "%lu" : ", %lu", (unsigned long)census.m_contexts[i]);
+    printf("], \"bytes_per_context\": %.2f, \"memory\": %lu, \"index_memory\": %lu, ",
+           (double)model->m_contexts.memory()/model->m_contexts.no_of_contexts(),
+           (unsigned long)model->m_contexts.memory(),
+           (unsigned long)model->m_contexts.index_memory());
+    model->decref();
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("\"peak_rss_kb\": %ld}\n", (long)ru.ru_maxrss);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = 1<<20;
+    int repeats = 3;
+    int threads = 1;
+    vector<int> orders;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:t:o:")) != -1) {
+        switch (opt) {
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'o':
+            for (const char *p = optarg; ; ++p) {
+                char *end;
+                long order = strtol(p, &end, 10);
+                if (end == p || order < 1 || order > Max_order ||
+                    (*end != ',' && *end != '\0')) {
+                    fprintf(stderr, "%s: orders must be from 1 to %d, separated by commas\n",
+                            argv[0], Max_order);
+                    return 2;
+                }
+                orders.push_back(order);
+                p = end;
+                if (*p == '\0')
+                    break;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s bytes] [-r repeats] [-t threads] [-o order,...] "
+                    "[corpus...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (size == 0 || repeats < 1 || threads < 1) {
+        fprintf(stderr, "%s: size, repeats and threads must be positive\n", argv[0]);
+        return 2;
+    }
+    if (orders.empty())
+        orders.push_back(Default_order);
+
+    vector<const Corpus *> selected;
+    for (int i = optind; i < argc; ++i) {
+        int c = 0;
+        while (c < No_of_corpora && strcmp(corpora[c].name, argv[i]) != 0)
+            ++c;
+        if (c == No_of_corpora) {
+            fprintf(stderr, "%s: unknown corpus %s\n", argv[0], argv[i]);
+            return 2;
+        }
+        selected.push_back(&corpora[c]);
+    }
+    if (selected.empty())
+        for (int c = 0; c < No_of_corpora; ++c)
+            selected.push_back(&corpora[c]);
+
+    int status = 0;
+    for (size_t i = 0; i < selected.size(); ++i) {
+        for (size_t o = 0; o < orders.size(); ++o) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                bool ok = bench_corpus(*selected[i], size, repeats, threads, orders[o]);
+                fflush(stdout);
+                _exit(ok ? 0 : 1);
+            }
+            int child = 0;
+            if (pid < 0 || waitpid(pid, &child, 0) < 0 ||
+                !WIFEXITED(child) || WEXITSTATUS(child) != 0) {
+                fprintf(stderr, "%s: corpus %s at order %d failed\n", argv[0],
+                        selected[i]->name, orders[o]);
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
@@ -0,0 +1,336 @@
+#ifndef _BLOCK_CONTAINER_H_
+#define _BLOCK_CONTAINER_H_
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+
+#include "config.h"
+#include "ppm_model.h"
+#include "io_adapter.h"
+
+//====================================================================
+// A container of independently coded blocks.
+//
+// The input is split into blocks, each coded with a model of its
+// own. That model starts empty, or as a fork of a frozen base model
+// that the reader must supply too, see PPMModel::fork. So the blocks
+// can be coded on several threads, and any block can be decoded
+// without the others, none of them copying the base.
+//
+// All the integers are little endian:
+//
+//   magic[4]           Container_magic
+//   u32 version        Container_version
+//   u32 coder          0 for ArithmeticCoder, 1 for RangeCoder
+//   u32 blocks         Number of blocks
+//   u64 raw_size       Bytes of the input
+//   u64 base           Contexts of the base model, 0 for none
+//   blocks x {         The block index
+//     u64 offset       Of the coded block in the container
+//     u64 size         Bytes of the coded block
+//     u64 raw_size     Bytes of the block before coding
+//   }
+//   the coded blocks
+//====================================================================
+
+#define Container_header_size 32
+#define Container_entry_size 24
+
+struct PPMBlock
+{
+    uint64_t offset;
+    uint64_t size;
+    uint64_t raw_offset;        // Of the block in the input
+    uint64_t raw_size;
+};
+
+inline void put_u32(unsigned char *p, uint32_t n)
+{
+    for (int i = 0; i < 4; ++i, n >>= 8)
+        p[i] = n & 0xFF;
+}
+inline void put_u64(unsigned char *p, uint64_t n)
+{
+    for (int i = 0; i < 8; ++i, n >>= 8)
+        p[i] = n & 0xFF;
+}
+inline uint32_t get_u32(const unsigned char *p)
+{
+    uint32_t n = 0;
+    for (int i = 3; i >= 0; --i)
+        n = (n << 8) | p[i];
+    return n;
+}
+inline uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t n = 0;
+    for (int i = 7; i >= 0; --i)
+        n = (n << 8) | p[i];
+    return n;
+}
+
+// The coder for blocks primed with base, see PPMBlockWriter
+inline int ppm_block_coder(const PPMModel *base)
+{
+    return base == NULL ||
+        base->m_contexts.max_frequency() <= ArithmeticCoder::max_frequency ? 0 : 1;
+}
+
+// The model a block is coded with, a fork of base or a new one
+// if base is NULL
+template<typename Coder>
+PPMModel *ppm_block_model(const PPMModel *base)
+{
+    if (base == NULL)
+        return new PPMModel(Coder::max_frequency);
+    PPMModel *model = base->fork();
+    assert(model != NULL);
+    return model;
+}
+
+template<typename Coder>
+void ppm_encode_block(const PPMModel *base, const unsigned char *data, size_t size,
+                      MemoryOutputAdapter &out)
+{
+    PPMModel *model = ppm_block_model<Coder>(base);
+    {
+        PPMEncoder<MemoryOutputAdapter, DefaultContextUpdater, Coder> penc(out, model);
+        penc.start_encoding();
+        penc.encode(data, size);
+        penc.finish_encoding();
+    }
+    model->decref();
+}
+
+// Return false if the block does not decode to exactly size bytes
+template<typename Coder>
+bool ppm_decode_block(const PPMModel *base, const unsigned char *data, size_t size,
+                      unsigned char *out, size_t out_size)
+{
+    PPMModel *model = ppm_block_model<Coder>(base);
+    MemoryInputAdapter mad(data, size);
+    size_t n = 0;
+    bool ok = true;
+    {
+        PPMDecoder<MemoryInputAdapter, DefaultContextUpdater, Coder> pdec(mad, model);
+        pdec.start_decoding();
+        for (;;) {
+            wsymbol_t sym = pdec.decode();
+            if (sym == EOF_symbol)
+                break;
+            if (n == out_size || mad.overrun() > Decode_max_overrun) {
+                ok = false;
+                break;
+            }
+            out[n++] = (unsigned char)sym;
+        }
+        pdec.finish_decoding();
+    }
+    model->decref();
+    return ok && n == out_size;
+}
+
+
+////////////////////////////////////////////////////////////
+// Code the input in blocks on several threads, then write the
+// container with write() into size() bytes.
+////////////////////////////////////////////////////////////
+class PPMBlockWriter
+{
+private:
+    const PPMModel *m_base;
+    const unsigned char *m_data;
+    std::vector<PPMBlock> m_blocks;
+    std::vector<MemoryOutputAdapter *> m_output;
+    size_t m_next;              // The first block no thread took yet
+
+    static void *encode_blocks(void *arg) {
+        PPMBlockWriter *w = (PPMBlockWriter *)arg;
+        for (;;) {
+            size_t i = __sync_fetch_and_add(&w->m_next, 1);
+            if (i >= w->m_blocks.size())
+                break;
+            const PPMBlock &b = w->m_blocks[i];
+            if (ppm_block_coder(w->m_base) == 0)
+                ppm_encode_block<ArithmeticCoder>(w->m_base, w->m_data+b.raw_offset,
+                                                  b.raw_size, *w->m_output[i]);
+            else
+                ppm_encode_block<RangeCoder>(w->m_base, w->m_data+b.raw_offset,
+                                             b.raw_size, *w->m_output[i]);
+        }
+        return NULL;
+    }
+
+    PPMBlockWriter(const PPMBlockWriter &);
+    PPMBlockWriter &operator = (const PPMBlockWriter &);
+
+public:
+    // base may be NULL, otherwise it must be frozen and not a
+    // fork, as for PPMModel::fork
+    PPMBlockWriter(const PPMModel *base)
+        :m_base(base), m_data(NULL), m_next(0) {
+    }
+    ~PPMBlockWriter() {
+        for (size_t i = 0; i < m_output.size(); ++i)
+            delete m_output[i];
+    }
+
+    void compress(const unsigned char *data, size_t size,
+                  size_t block_size=Container_block_size, int threads=1) {
+        m_data = data;
+        for (size_t begin = 0; begin < size; begin += block_size) {
+            PPMBlock b = { 0, 0, begin, size-begin < block_size ? size-begin : block_size };
+            m_blocks.push_back(b);
+            m_output.push_back(new MemoryOutputAdapter());
+        }
+
+        m_next = 0;
+        ppm_run_threads(encode_blocks, this, threads);
+
+        uint64_t offset = Container_header_size + Container_entry_size*m_blocks.size();
+        for (size_t i = 0; i < m_blocks.size(); ++i) {
+            m_blocks[i].offset = offset;
+            m_blocks[i].size = m_output[i]->size();
+            offset += m_blocks[i].size;
+        }
+    }
+
+    size_t size() const {
+        if (m_blocks.empty())
+            return Container_header_size;
+        return m_blocks.back().offset + m_blocks.back().size;
+    }
+
+    void write(unsigned char *out) const {
+        memcpy(out, Container_magic, 4);
+        put_u32(out+4, Container_version);
+        put_u32(out+8, ppm_block_coder(m_base));
+        put_u32(out+12, m_blocks.size());
+        put_u64(out+16, m_blocks.empty() ? 0 :
+                m_blocks.back().raw_offset + m_blocks.back().raw_size);
+        put_u64(out+24, m_base == NULL ? 0 : m_base->m_contexts.no_of_contexts());
+
+        unsigned char *entry = out+Container_header_size;
+        for (size_t i = 0; i < m_blocks.size(); ++i, entry += Container_entry_size) {
+            put_u64(entry, m_blocks[i].offset);
+            put_u64(entry+8, m_blocks[i].size);
+            put_u64(entry+16, m_blocks[i].raw_size);
+            if (m_blocks[i].size > 0)
+                memcpy(out+m_blocks[i].offset, m_output[i]->data(), m_blocks[i].size);
+        }
+    }
+};
+
+
+////////////////////////////////////////////////////////////
+// Read the index of a container, and decode any of its blocks
+// or all of them on several threads.
+////////////////////////////////////////////////////////////
+class PPMBlockReader
+{
+private:
+    const unsigned char *m_data;
+    int m_coder;
+    uint64_t m_raw_size;
+    uint64_t m_base;            // Contexts of the base model
+    std::vector<PPMBlock> m_blocks;
+
+    // For decompress_all
+    const PPMModel *m_model;
+    unsigned char *m_out;
+    size_t m_next;
+    bool m_ok;
+
+    static void *decode_blocks(void *arg) {
+        PPMBlockReader *r = (PPMBlockReader *)arg;
+        for (;;) {
+            size_t i = __sync_fetch_and_add(&r->m_next, 1);
+            if (i >= r->m_blocks.size())
+                break;
+            if (!r->decompress(i, r->m_model, r->m_out+r->m_blocks[i].raw_offset))
+                r->m_ok = false;
+        }
+        return NULL;
+    }
+
+    PPMBlockReader(const PPMBlockReader &);
+    PPMBlockReader &operator = (const PPMBlockReader &);
+
+public:
+    PPMBlockReader()
+        :m_data(NULL), m_coder(0), m_raw_size(0), m_base(0) {
+    }
+
+    // Return false if data is not a valid container
+    bool open(const unsigned char *data, size_t size) {
+        m_blocks.clear();
+        if (size < Container_header_size ||
+            memcmp(data, Container_magic, 4) != 0 ||
+            get_u32(data+4) != Container_version)
+            return false;
+
+        m_data = data;
+        m_coder = get_u32(data+8);
+        uint64_t n = get_u32(data+12);
+        m_raw_size = get_u64(data+16);
+        m_base = get_u64(data+24);
+        if (m_coder > 1 || n > (size-Container_header_size)/Container_entry_size)
+            return false;
+
+        const unsigned char *entry = data+Container_header_size;
+        uint64_t raw_offset = 0;
+        for (uint64_t i = 0; i < n; ++i, entry += Container_entry_size) {
+            PPMBlock b = { get_u64(entry), get_u64(entry+8), raw_offset, get_u64(entry+16) };
+            if (b.offset > size || b.size > size-b.offset ||
+                b.raw_size > m_raw_size-raw_offset)
+                return false;
+            raw_offset += b.raw_size;
+            m_blocks.push_back(b);
+        }
+        return raw_offset == m_raw_size;
+    }
+
+    size_t raw_size() const {
+        return m_raw_size;
+    }
+    size_t block_count() const {
+        return m_blocks.size();
+    }
+    const PPMBlock &block(size_t i) const {
+        return m_blocks[i];
+    }
+
+    // Whether the blocks can be decoded with base, which may be
+    // NULL, otherwise frozen as for PPMBlockWriter. Only the
+    // number of contexts is compared.
+    bool check_base(const PPMModel *base) const {
+        uint64_t contexts = base == NULL ? 0 : base->m_contexts.no_of_contexts();
+        return contexts == m_base && ppm_block_coder(base) == m_coder;
+    }
+
+    // Decode block i into the block(i).raw_size bytes at out,
+    // return false if it is corrupt
+    bool decompress(size_t i, const PPMModel *base, unsigned char *out) const {
+        const PPMBlock &b = m_blocks[i];
+        if (m_coder == 0)
+            return ppm_decode_block<ArithmeticCoder>(base, m_data+b.offset, b.size,
+                                                     out, b.raw_size);
+        else
+            return ppm_decode_block<RangeCoder>(base, m_data+b.offset, b.size,
+                                                out, b.raw_size);
+    }
+
+    // Decode all the blocks into the raw_size() bytes at out
+    bool decompress_all(const PPMModel *base, unsigned char *out, int threads=1) {
+        m_model = base;
+        m_out = out;
+        m_next = 0;
+        m_ok = true;
+        ppm_run_threads(decode_blocks, this, threads);
+        return m_ok;
+    }
+};
+
+#endif /* _BLOCK_CONTAINER_H_ */
@@ -2,41 +2,54 @@
 #define _BUFFER_H_
 
 #include <cstring>
+#include <stdint.h>
 
 #include "config.h"
 
 class Buffer
 {
 private:
-    symbol_t m_buf[Max_no_contexts+Max_no_contexts];
+    symbol_t m_buf[Max_order+Max_order];
     symbol_t *m_base;
     int m_offset;
     int m_length;
+    int m_order;                // Values kept, at most Max_order
+    uint64_t m_key;             // The last 8 values, see key
 
 public:
-    Buffer()
-        :m_base(m_buf), m_offset(0), m_length(0)
+    Buffer(int order=Default_order)
+        :m_base(m_buf), m_offset(0), m_length(0), m_order(order), m_key(0)
         { }
 
     void reset() {
         m_base = m_buf;
         m_offset = 0;
         m_length = 0;
+        m_key = 0;
     }
 
+    // Keep the last order values from now on, the buffer is
+    // emptied
+    void set_order(int order) {
+        m_order = order;
+        reset();
+    }
+    int order() const { return m_order; }
+
     // Append a value to the buffer, the buffer holds
-    // at most N values, earlier values will be discarded
+    // at most order values, earlier values will be discarded
     // when necessary.
     void operator << (symbol_t value) {
         m_buf[m_offset++] = value;
+        m_key = m_key << 8 | value;
         
-        if (m_length < Max_no_contexts) {
+        if (m_length < m_order) {
             m_length++;
         } else {
             m_base++;
-            if (m_offset == Max_no_contexts+Max_no_contexts) {
-                std::memmove(m_buf, m_buf+Max_no_contexts, Max_no_contexts);
-                m_offset = Max_no_contexts;
+            if (m_offset == m_order+m_order) {
+                std::memmove(m_buf, m_buf+m_order, m_order);
+                m_offset = m_order;
                 m_base = m_buf;
             }
         }
@@ -50,6 +63,10 @@ public:
 
     // Get the length of the buffer
     int length() const { return m_length; }
+
+    // The last 8 values packed in an integer, the last one in the
+    // low byte, zeros before the first one
+    uint64_t key() const { return m_key; }
 };
 
 #endif /* _BUFFER_H_ */
@@ -12,11 +12,42 @@ typedef unsigned char symbol_t;
 // ESC and EOF
 typedef int wsymbol_t;
 
-// Max number of contexts in the PPM model
-#define Max_no_contexts 6
+// Order of the PPM model, the length of its longest contexts. It
+// is chosen when the model is created, new models get
+// Default_order, any order from 1 up to Max_order can be asked for
+#define Default_order 6
+#define Max_order 32
 
 #define No_of_chars 256             /* Number of character(byte) symbols */
 
+// A context switches to tables indexed by symbol when it has more
+// children or leaves than these, and its leaf table goes back to a
+// list when fewer leaves than Sparse_leaves_threshold survive
+// rescaling
+#define Dense_children_threshold 32
+#define Dense_leaves_threshold 32
+#define Sparse_leaves_threshold 16
+
+// Whether new models exclude the symbols of the contexts a symbol
+// escaped from when coding it in the shorter ones
+#define Default_exclusion 1
+
+// Whether new models find their contexts through a hashed index,
+// until they are given a memory limit, see Trie::set_context_index
+#define Default_context_index 1
+
+// When the memory budget of a model runs out, contexts shorter
+// than Prune_min_order are kept, and pruning releases at least
+// 1/Prune_fraction of the contexts
+#define Prune_min_order 2
+#define Prune_fraction 4
+
+// Parallel training gives each thread at least this many bytes
+#define Train_min_shard (1<<16)
+
+// Batch scoring threads take this many records at a time
+#define Score_batch_chunk 64
+
 #define EOF_symbol (No_of_chars+0)  /* the EOF symbol */
 #define ESC_symbol (No_of_chars+1)  /* the Escape symbol */
 
@@ -45,4 +76,61 @@ typedef unsigned long code_value;   /* Type of an arithmetic code
 #define Third_qtr (3*First_qtr)     /* Point after third quarter */
 
 
+////////////////////////////////////////////////////////////
+// Range Codec parameters
+////////////////////////////////////////////////////////////
+
+#define Range_bottom (1U<<24)       /* Renormalize when the range
+                                     * gets below this */
+
+#define Range_max_frequency ((1<<16)-2) /* Max total frequency, bounded
+                                         * by the unsigned short counts
+                                         * of the trie */
+
+
+////////////////////////////////////////////////////////////
+// Model snapshot parameters
+////////////////////////////////////////////////////////////
+
+#define Snapshot_magic "PPMS"       /* First 4 bytes of a snapshot */
+#define Snapshot_version 3          /* Bumped on layout changes */
+#define Snapshot_byte_order 0x01020304 /* Stored in host byte order,
+                                        * snapshots are not portable
+                                        * across endianness */
+#define Snapshot_alignment 4096     /* The blocks start at multiples
+                                     * of this, so they can be mapped
+                                     * page by page */
+
+
+
+////////////////////////////////////////////////////////////
+// Memory parameters
+////////////////////////////////////////////////////////////
+
+#define Arena_chunk_size (2<<20)    /* Slab blocks are carved from
+                                     * chunks of this many bytes, the
+                                     * size of a huge page */
+#define Arena_heap_size (1<<20)     /* The first blocks of a trie, up
+                                     * to this many bytes, come from
+                                     * the heap, so small ones do not
+                                     * take a whole chunk */
+#define Arena_pool_chunks 16        /* Free chunks kept for reuse by
+                                     * the process by default, the rest
+                                     * are unmapped, see
+                                     * ChunkPool::set_limit */
+
+
+////////////////////////////////////////////////////////////
+// Block container parameters
+////////////////////////////////////////////////////////////
+
+#define Container_magic "PPMF"      /* First 4 bytes of a container */
+#define Container_version 2          /* Bumped when the coding changes */
+#define Container_block_size (1<<20) /* Default bytes per block */
+
+// Decoding stops with an error when the decoder has read this
+// many bytes past the end of its input
+#define Decode_max_overrun 16
+
+
 #endif /* _CONFIG_H_ */
@@ -0,0 +1,191 @@
+#ifndef _CONTEXT_INDEX_H_
+#define _CONTEXT_INDEX_H_
+
+#include <vector>
+#include <stdint.h>
+
+#include "config.h"
+#include "slab_allocator.h"
+
+//====================================================================
+// Finds the contexts of a trie by their symbols in one probe per
+// order, instead of a walk down the trie one node per symbol.
+//
+// A context of order k up to Index_max_order is keyed by its k
+// symbols packed in a 64-bit integer, the most recent one in the
+// low byte, as Buffer::key gives them. The key holds the whole
+// context, so a probe never returns another one.
+//
+// * Order 1 and 2 contexts are in tables indexed by the key
+//   itself, 256 and 65536 slots.
+// * Longer ones are in an open-addressing hash table of the key
+//   and the order, with linear probing. It grows to keep at most
+//   half of its slots used.
+//
+// The index may hold any subset of the contexts, the trie finds
+// the others child by child. The tables are allocated with the
+// first entry. Entries are never removed one by one: the index is
+// cleared when the trie releases contexts.
+// Every entry is stamped with the generation it was added in, and
+// clearing starts a new one, so it takes no time however often the
+// trie reclaims memory.
+//====================================================================
+
+enum { Index_max_order = 8 };   // The symbols that fit in a key
+
+// A slot of the order 1 and 2 tables
+struct ContextIndexSlot
+{
+    slab_index node;
+    uint32_t generation;        // Empty unless the current one
+};
+
+// A slot of the hash table
+struct ContextIndexEntry
+{
+    uint64_t key;
+    slab_index node;
+    uint32_t tag;               // The generation << 8 | the order,
+                                // empty unless the current generation
+};
+
+class ContextIndex
+{
+private:
+    enum {
+        Min_bits = 12,          // Slots of the smallest hash table
+        Max_generation = 1<<24  // Wiped when it gets there
+    };
+
+    std::vector<ContextIndexSlot> m_order1;
+    std::vector<ContextIndexSlot> m_order2;
+    std::vector<ContextIndexEntry> m_table;
+    int m_bits;                 // m_table has 2^m_bits slots
+    size_t m_count;             // Entries of the generation
+    size_t m_table_count;       // Those of them in m_table
+    uint32_t m_generation;      // 0 in no slot
+
+    size_t slot(uint64_t key, int order) const {
+        uint64_t h = (key ^ (uint64_t)order << 59) * 0x9E3779B97F4A7C15ULL;
+        return (size_t)(h >> (64-m_bits));
+    }
+
+    bool current(const ContextIndexEntry &e) const {
+        return e.tag >> 8 == m_generation;
+    }
+
+    void put(uint64_t key, uint32_t tag, slab_index node) {
+        size_t mask = m_table.size()-1;
+        size_t s = slot(key, tag & 0xFF);
+        while (current(m_table[s]) && (m_table[s].key != key || m_table[s].tag != tag))
+            s = (s+1) & mask;
+        m_table_count += !current(m_table[s]);
+        m_table[s].key = key;
+        m_table[s].node = node;
+        m_table[s].tag = tag;
+    }
+
+    void allocate() {
+        m_order1.assign(1 << 8, ContextIndexSlot());
+        m_order2.assign(1 << 16, ContextIndexSlot());
+        m_bits = Min_bits;
+        m_table.assign((size_t)1 << m_bits, ContextIndexEntry());
+        m_generation = 1;
+    }
+
+    void grow() {
+        std::vector<ContextIndexEntry> old;
+        old.swap(m_table);
+        ++m_bits;
+        m_table.assign((size_t)1 << m_bits, ContextIndexEntry());
+        m_table_count = 0;
+        for (size_t s = 0; s < old.size(); ++s)
+            if (current(old[s]))
+                put(old[s].key, old[s].tag, old[s].node);
+    }
+
+public:
+    ContextIndex()
+        :m_bits(0), m_count(0), m_table_count(0), m_generation(0) {
+    }
+
+    // The key of the order-k context of key, k <= Index_max_order
+    static uint64_t mask(uint64_t key, int order) {
+        return order < 8 ? key & (((uint64_t)1 << 8*order) - 1) : key;
+    }
+
+    // Whether there is no entry, find and prefetch must not be
+    // called then
+    bool empty() const {
+        return m_count == 0;
+    }
+
+    // Drop all entries, the tables are kept
+    void clear() {
+        m_count = 0;
+        m_table_count = 0;
+        if (!m_order1.empty() && ++m_generation == Max_generation)
+            release();
+    }
+
+    // Drop all entries and free the tables
+    void release() {
+        std::vector<ContextIndexSlot>().swap(m_order1);
+        std::vector<ContextIndexSlot>().swap(m_order2);
+        std::vector<ContextIndexEntry>().swap(m_table);
+        m_bits = 0;
+        m_count = 0;
+        m_table_count = 0;
+        m_generation = 0;
+    }
+
+    // The node of the order-k context with this key, 0 if the
+    // index does not have it. key is masked to the order.
+    slab_index find(uint64_t key, int order) const {
+        key = mask(key, order);
+        if (order <= 2) {
+            const ContextIndexSlot &s = order == 1 ? m_order1[key] : m_order2[key];
+            return s.generation == m_generation ? s.node : 0;
+        }
+
+        uint32_t tag = m_generation << 8 | order;
+        size_t mask = m_table.size()-1;
+        for (size_t s = slot(key, order); current(m_table[s]); s = (s+1) & mask)
+            if (m_table[s].key == key && m_table[s].tag == tag)
+                return m_table[s].node;
+        return 0;
+    }
+
+    // Bring the slot of a context into the cache ahead of find
+    void prefetch(uint64_t key, int order) const {
+        if (order > 2)
+            __builtin_prefetch(&m_table[slot(mask(key, order), order)]);
+    }
+
+    // Add the order-k context with this key
+    void insert(uint64_t key, int order, slab_index node) {
+        if (m_order1.empty())
+            allocate();
+        key = mask(key, order);
+        if (order <= 2) {
+            ContextIndexSlot &s = order == 1 ? m_order1[key] : m_order2[key];
+            m_count += s.generation != m_generation;
+            s.node = node;
+            s.generation = m_generation;
+        } else {
+            if (2*(m_table_count+1) > m_table.size())
+                grow();
+            size_t n = m_table_count;
+            put(key, m_generation << 8 | order, node);
+            m_count += m_table_count - n;
+        }
+    }
+
+    // Bytes taken by the tables
+    size_t memory() const {
+        return (m_order1.size() + m_order2.size())*sizeof(ContextIndexSlot) +
+            m_table.size()*sizeof(ContextIndexEntry);
+    }
+};
+
+#endif /* _CONTEXT_INDEX_H_ */
@@ -0,0 +1,332 @@
+#ifndef _CUM_FREQ_H_
+#define _CUM_FREQ_H_
+
+#include <cstdlib>
+#include <cstring>
+
+#include "config.h"
+
+//====================================================================
+// Cumulative frequencies over the counts of a leaf table, the
+// No_of_chars counts of a context indexed by symbol.
+//
+// The counts are grouped in blocks of Cum_freq_block_size, and a
+// Fenwick tree over the sums of the blocks finds the block of a
+// cumulative frequency, or the sum of the blocks before a symbol,
+// in log2(Cum_freq_blocks) steps. An increment updates as many
+// nodes. Within a block the counts are summed or searched by a
+// kernel.
+//
+// All the counts of a context add up to less than its max
+// frequency, which fits in an unsigned short, so every partial sum
+// does too. The kernels add 8 (SSE2) or 16 (AVX2) counts at a time
+// in 16-bit lanes without widening. The widest kernel the CPU
+// supports is chosen on first use; the environment variable
+// PPM_SIMD=scalar|sse2|avx2 can ask for a narrower one. Other
+// compilers and CPUs get the scalar loops.
+//====================================================================
+
+#define Cum_freq_block_size 16
+#define Cum_freq_blocks (No_of_chars/Cum_freq_block_size)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PPM_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+enum {
+    Simd_scalar,
+    Simd_sse2,
+    Simd_avx2
+};
+
+inline int cum_freq_detect()
+{
+    int level = Simd_scalar;
+#ifdef PPM_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        level = Simd_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        level = Simd_avx2;
+#endif
+    const char *env = getenv("PPM_SIMD");
+    if (env != NULL) {
+        if (strcmp(env, "scalar") == 0)
+            level = Simd_scalar;
+        else if (strcmp(env, "sse2") == 0 && level > Simd_sse2)
+            level = Simd_sse2;
+    }
+    return level;
+}
+
+// The kernel level in use, detected once by the first call. The
+// initialization is thread-safe, threads racing on the first call
+// wait for it.
+inline int cum_freq_level()
+{
+    static const int level = cum_freq_detect();
+    return level;
+}
+
+
+////////////////////////////////////////////////////////////
+// Scalar kernels
+////////////////////////////////////////////////////////////
+
+// Sum of count[0..sym)
+inline unsigned cum_freq_below_scalar(const unsigned short *count, int sym)
+{
+    unsigned cum = 0;
+    for (int s = 0; s < sym; ++s)
+        cum += count[s];
+    return cum;
+}
+
+// The s with below <= cum < below+count[s] among the n counts,
+// where below is the sum of count[0..s). Return n if cum is not
+// below the sum of all of them, below is then that sum. n is a
+// multiple of 16.
+inline int cum_freq_find_scalar(const unsigned short *count, int n, unsigned cum,
+                                unsigned &below)
+{
+    unsigned curr = 0;
+    int s = 0;
+    while (s < n && curr+count[s] <= cum) {
+        curr += count[s];
+        ++s;
+    }
+    below = curr;
+    return s;
+}
+
+
+#ifdef PPM_SIMD_X86
+
+////////////////////////////////////////////////////////////
+// SSE2 kernels
+////////////////////////////////////////////////////////////
+
+__attribute__((target("sse2")))
+inline unsigned cum_freq_below_sse2(const unsigned short *count, int sym)
+{
+    __m128i acc = _mm_setzero_si128();
+    int s = 0;
+    for (; s+8 <= sym; s += 8)
+        acc = _mm_add_epi16(acc, _mm_loadu_si128((const __m128i *)(count+s)));
+    if (s < sym) {
+        // Lanes s..sym-1 of the last 8, the block has room for all
+        __m128i lane = _mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0);
+        __m128i mask = _mm_cmpgt_epi16(_mm_set1_epi16(sym-s), lane);
+        __m128i v = _mm_loadu_si128((const __m128i *)(count+s));
+        acc = _mm_add_epi16(acc, _mm_and_si128(v, mask));
+    }
+    acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 4));
+    acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 2));
+    return (unsigned short)_mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("sse2")))
+inline int cum_freq_find_sse2(const unsigned short *count, int n, unsigned cum,
+                              unsigned &below)
+{
+    const __m128i target = _mm_set1_epi16((short)cum);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i curr = zero;        // The sum of the counts so far, in all lanes
+
+    for (int s = 0; s < n; s += 8) {
+        // Inclusive prefix sums of the 8 counts, on top of curr
+        __m128i p = _mm_loadu_si128((const __m128i *)(count+s));
+        p = _mm_add_epi16(p, _mm_slli_si128(p, 2));
+        p = _mm_add_epi16(p, _mm_slli_si128(p, 4));
+        p = _mm_add_epi16(p, _mm_slli_si128(p, 8));
+        p = _mm_add_epi16(p, curr);
+
+        // Lanes with a sum above cum, which saturates to non-zero
+        int above = ~_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(p, target),
+                                                       zero)) & 0xFFFF;
+        if (above != 0) {
+            int j = __builtin_ctz(above)/2;
+            unsigned short sum[8];
+            _mm_storeu_si128((__m128i *)sum, p);
+            below = sum[j]-count[s+j];
+            return s+j;
+        }
+        curr = _mm_shufflehi_epi16(p, 0xFF);
+        curr = _mm_unpackhi_epi64(curr, curr);
+    }
+    below = (unsigned short)_mm_cvtsi128_si32(curr);
+    return n;
+}
+
+
+////////////////////////////////////////////////////////////
+// AVX2 kernels
+////////////////////////////////////////////////////////////
+
+__attribute__((target("avx2")))
+inline unsigned cum_freq_below_avx2(const unsigned short *count, int sym)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int s = 0;
+    for (; s+16 <= sym; s += 16)
+        acc = _mm256_add_epi16(acc, _mm256_loadu_si256((const __m256i *)(count+s)));
+    if (s < sym) {
+        __m256i lane = _mm256_set_epi16(15, 14, 13, 12, 11, 10, 9, 8,
+                                        7, 6, 5, 4, 3, 2, 1, 0);
+        __m256i mask = _mm256_cmpgt_epi16(_mm256_set1_epi16(sym-s), lane);
+        __m256i v = _mm256_loadu_si256((const __m256i *)(count+s));
+        acc = _mm256_add_epi16(acc, _mm256_and_si256(v, mask));
+    }
+    __m128i sum = _mm_add_epi16(_mm256_castsi256_si128(acc),
+                                _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 4));
+    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 2));
+    return (unsigned short)_mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2")))
+inline int cum_freq_find_avx2(const unsigned short *count, int n, unsigned cum,
+                              unsigned &below)
+{
+    const __m256i target = _mm256_set1_epi16((short)cum);
+    const __m256i zero = _mm256_setzero_si256();
+    // Picks word 7 of each 128-bit half
+    const __m256i last = _mm256_set1_epi16(0x0F0E);
+    __m256i curr = zero;
+
+    for (int s = 0; s < n; s += 16) {
+        // Prefix sums within each half, then the low half's total
+        // carried into the high half
+        __m256i p = _mm256_loadu_si256((const __m256i *)(count+s));
+        p = _mm256_add_epi16(p, _mm256_slli_si256(p, 2));
+        p = _mm256_add_epi16(p, _mm256_slli_si256(p, 4));
+        p = _mm256_add_epi16(p, _mm256_slli_si256(p, 8));
+        __m256i carry = _mm256_shuffle_epi8(p, last);
+        p = _mm256_add_epi16(p, _mm256_permute2x128_si256(carry, carry, 0x08));
+        p = _mm256_add_epi16(p, curr);
+
+        int above = ~_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_subs_epu16(p, target),
+                                                             zero));
+        if (above != 0) {
+            int j = __builtin_ctz(above)/2;
+            unsigned short sum[16];
+            _mm256_storeu_si256((__m256i *)sum, p);
+            below = sum[j]-count[s+j];
+            return s+j;
+        }
+        curr = _mm256_shuffle_epi8(p, last);
+        curr = _mm256_permute2x128_si256(curr, curr, 0x11);
+    }
+    below = (unsigned short)_mm_cvtsi128_si32(_mm256_castsi256_si128(curr));
+    return n;
+}
+
+#endif /* PPM_SIMD_X86 */
+
+
+////////////////////////////////////////////////////////////
+// Dispatch to the kernels of cum_freq_level()
+////////////////////////////////////////////////////////////
+
+// Sum of count[0..sym), within one block
+inline unsigned cum_freq_sum(const unsigned short *count, int sym)
+{
+#ifdef PPM_SIMD_X86
+    switch (cum_freq_level()) {
+    case Simd_avx2:
+        return cum_freq_below_avx2(count, sym);
+    case Simd_sse2:
+        return cum_freq_below_sse2(count, sym);
+    }
+#endif
+    return cum_freq_below_scalar(count, sym);
+}
+
+// Search the n counts, see cum_freq_find_scalar
+inline int cum_freq_search(const unsigned short *count, int n, unsigned cum,
+                           unsigned &below)
+{
+#ifdef PPM_SIMD_X86
+    switch (cum_freq_level()) {
+    case Simd_avx2:
+        return cum_freq_find_avx2(count, n, cum, below);
+    case Simd_sse2:
+        return cum_freq_find_sse2(count, n, cum, below);
+    }
+#endif
+    return cum_freq_find_scalar(count, n, cum, below);
+}
+
+
+////////////////////////////////////////////////////////////
+// The Fenwick tree of a leaf table. tree[i-1] holds the sum of
+// the blocks (i-(i&-i), i], counting blocks from 1.
+////////////////////////////////////////////////////////////
+
+// Rebuild the tree from all the counts
+inline void cum_freq_build(const unsigned short *count, unsigned short *tree)
+{
+    for (int b = 0; b < Cum_freq_blocks; ++b)
+        tree[b] = cum_freq_sum(count+b*Cum_freq_block_size, Cum_freq_block_size);
+    for (int i = 1; i < Cum_freq_blocks; ++i) {
+        int parent = i + (i & -i);
+        if (parent <= Cum_freq_blocks)
+            tree[parent-1] += tree[i-1];
+    }
+}
+
+// Sum of all the counts
+inline unsigned cum_freq_total(const unsigned short *tree)
+{
+    return tree[Cum_freq_blocks-1];
+}
+
+// Account for n more of sym, after its count is raised by n
+inline void cum_freq_add(unsigned short *tree, int sym, int n)
+{
+    for (int i = sym/Cum_freq_block_size+1; i <= Cum_freq_blocks; i += i & -i)
+        tree[i-1] += n;
+}
+
+// Sum of count[0..sym)
+inline unsigned cum_freq_below(const unsigned short *count, const unsigned short *tree,
+                               int sym)
+{
+    int block = sym/Cum_freq_block_size;
+    unsigned cum = 0;
+    for (int i = block; i > 0; i -= i & -i)
+        cum += tree[i-1];
+    int first = block*Cum_freq_block_size;
+    return cum + cum_freq_sum(count+first, sym-first);
+}
+
+// The symbol s with below <= cum < below+count[s], where below is
+// the sum of count[0..s). Return No_of_chars if cum is not below
+// the sum of all counts, below is then that sum.
+inline int cum_freq_find(const unsigned short *count, const unsigned short *tree,
+                         unsigned cum, unsigned &below)
+{
+    // The most blocks whose sum is not above cum
+    int block = 0;
+    unsigned rest = cum;
+    for (int step = Cum_freq_blocks/2; step > 0; step /= 2) {
+        if (tree[block+step-1] <= rest) {
+            block += step;
+            rest -= tree[block-1];
+        }
+    }
+    if (block == Cum_freq_blocks) {
+        below = cum-rest;
+        return No_of_chars;
+    }
+
+    int first = block*Cum_freq_block_size;
+    int s = cum_freq_search(count+first, Cum_freq_block_size, rest, below);
+    below += cum-rest;
+    return first+s;
+}
+
+#endif /* _CUM_FREQ_H_ */
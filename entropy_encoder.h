@@ -0,0 +1,51 @@
+#ifndef _ENTROPY_ENCODER_H_
+#define _ENTROPY_ENCODER_H_
+
+#include <cmath>
+
+#include "config.h"
+
+////////////////////////////////////////////////////////////
+// Adds up the information content of the coded symbols,
+// -log2 of their probabilities, without coding them. The
+// writer gets the sum in bits when encoding finishes, see
+// CostAdapter.
+//
+// The probabilities are multiplied into a double, whose
+// exponent is moved out into an integer before it can
+// underflow, so only one log2 is taken per message.
+////////////////////////////////////////////////////////////
+template<typename CostWriter>
+class EntropyEncoder
+{
+private:
+    CostWriter &m_writer;
+    double m_product;           // The probability is m_product*2^m_exponent
+    int m_exponent;
+
+public:
+    EntropyEncoder(CostWriter &writer)
+        :m_writer(writer), m_product(1.0), m_exponent(0) {
+    }
+
+    // Encode a symbol, as ArithmeticEncoder::encode
+    void encode(code_value low, code_value high, code_value total) {
+        m_product *= (double)(high-low)/total;
+        // A factor is at least 1/total, far from the smallest double
+        if (m_product < 1e-200) {
+            int e;
+            m_product = frexp(m_product, &e);
+            m_exponent += e;
+        }
+    }
+
+    // Give the writer the bits of all the symbols since the last
+    // call
+    void finish_encoding() {
+        m_writer.add(-(log2(m_product) + m_exponent));
+        m_product = 1.0;
+        m_exponent = 0;
+    }
+};
+
+#endif /* _ENTROPY_ENCODER_H_ */
@@ -2,18 +2,80 @@
 #define _IO_ADAPTER_H_
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Size of the blocks the file adapters read and write at a time
+#define IO_block_size (1<<16)
+
+////////////////////////////////////////////////////////////
+// Output adapters are called once per byte by the encoders,
+// flush() is called when the encoding is finished.
+////////////////////////////////////////////////////////////
 
 class FileOutputAdapter
 {
 private:
     std::FILE *m_fout;
+    unsigned char m_block[IO_block_size];
+    size_t m_size;
 public:
     FileOutputAdapter(FILE *f)
-        :m_fout(f) {
+        :m_fout(f), m_size(0) {
     }
-    
+    // Write what is left, the file is not flushed: it may be
+    // closed already if flush() was called last
+    ~FileOutputAdapter() {
+        if (m_size > 0)
+            std::fwrite(m_block, 1, m_size, m_fout);
+    }
+
     void operator() (int ch) {
-        std::fputc(ch, m_fout);
+        if (m_size == sizeof(m_block))
+            flush();
+        m_block[m_size++] = (unsigned char)ch;
+    }
+
+    void flush() {
+        if (m_size > 0) {
+            std::fwrite(m_block, 1, m_size, m_fout);
+            m_size = 0;
+        }
+        std::fflush(m_fout);
+    }
+};
+
+// Collect the output in a growable memory buffer
+class MemoryOutputAdapter
+{
+private:
+    std::vector<unsigned char> m_data;
+public:
+    MemoryOutputAdapter() {
+        m_data.reserve(IO_block_size);
+    }
+
+    void operator() (int ch) {
+        m_data.push_back((unsigned char)ch);
+    }
+
+    void flush() {
+    }
+
+    const unsigned char *data() const {
+        return m_data.empty() ? NULL : &m_data[0];
+    }
+    size_t size() const {
+        return m_data.size();
+    }
+    void clear() {
+        m_data.clear();
     }
 };
 
@@ -29,23 +91,232 @@ public:
     int count() {
         return m_count;
     }
-    
+
     void operator() (int ch) {
         ++m_count;
     }
+
+    void flush() {
+    }
+};
+
+// Takes the cost in bits of what EntropyEncoder encodes instead
+// of its output
+class CostAdapter
+{
+private:
+    double m_bits;
+public:
+    CostAdapter()
+        :m_bits(0) {
+    }
+
+    double bits() const {
+        return m_bits;
+    }
+
+    void add(double bits) {
+        m_bits += bits;
+    }
 };
 
+////////////////////////////////////////////////////////////
+// Input adapters return the next byte, or EOF at the end.
+////////////////////////////////////////////////////////////
+
 class FileInputAdapter
 {
 private:
     std::FILE *m_fin;
+    unsigned char m_block[IO_block_size];
+    size_t m_pos;
+    size_t m_size;
 public:
     FileInputAdapter(FILE *f)
-        :m_fin(f) {
+        :m_fin(f), m_pos(0), m_size(0) {
     }
-    
+
     int operator() () {
-        return std::fgetc(m_fin);
+        if (m_pos == m_size) {
+            m_size = std::fread(m_block, 1, sizeof(m_block), m_fin);
+            m_pos = 0;
+            if (m_size == 0)
+                return EOF;
+        }
+        return m_block[m_pos++];
+    }
+};
+
+class MemoryInputAdapter
+{
+private:
+    const unsigned char *m_data;
+    const unsigned char *m_end;
+    size_t m_overrun;
+public:
+    MemoryInputAdapter(const unsigned char *data, size_t size)
+        :m_data(data), m_end(data+size), m_overrun(0) {
+    }
+
+    int operator() () {
+        if (m_data == m_end) {
+            ++m_overrun;
+            return EOF;
+        }
+        return *m_data++;
+    }
+
+    // Times EOF was returned. A decoder reads a few bytes ahead,
+    // many more mean the input is truncated or corrupt.
+    size_t overrun() const {
+        return m_overrun;
+    }
+};
+
+// Input fed in chunks as it arrives. EOF is returned when the
+// data fed so far is used up, the used data is dropped as more
+// is fed, but for the last Unread_max bytes, see unread.
+class StreamInputAdapter
+{
+private:
+    enum { Unread_max = 8 };
+
+    std::vector<unsigned char> m_data;
+    size_t m_pos;
+    size_t m_overrun;
+public:
+    StreamInputAdapter()
+        :m_pos(0), m_overrun(0) {
+    }
+
+    void feed(const unsigned char *data, size_t size) {
+        if (m_pos > Unread_max && m_pos >= m_data.size()/2) {
+            size_t used = m_pos-Unread_max;
+            m_data.erase(m_data.begin(), m_data.begin()+used);
+            m_pos -= used;
+        }
+        m_data.insert(m_data.end(), data, data+size);
+    }
+
+    // Bytes fed but not read yet, and where they are
+    size_t available() const {
+        return m_data.size()-m_pos;
+    }
+    const unsigned char *data() const {
+        return m_data.empty() ? NULL : &m_data[0]+m_pos;
+    }
+
+    // Take back the last n bytes read, n <= Unread_max, so that
+    // they are available again
+    void unread(size_t n) {
+        m_pos -= n < m_pos ? n : m_pos;
+    }
+
+    int operator() () {
+        if (m_pos == m_data.size()) {
+            ++m_overrun;
+            return EOF;
+        }
+        return m_data[m_pos++];
+    }
+
+    // Times EOF was returned, see MemoryInputAdapter
+    size_t overrun() const {
+        return m_overrun;
+    }
+};
+
+////////////////////////////////////////////////////////////
+// The whole content of a file in memory. The file is mapped
+// when possible, otherwise (e.g. a pipe) it is read in.
+//
+// The mapping is private: with PROT_WRITE the pages are copied
+// on write, untouched pages stay shared with other processes.
+////////////////////////////////////////////////////////////
+class MappedFile
+{
+private:
+    unsigned char *m_data;
+    size_t m_size;
+    bool m_mapped;
+
+    void close() {
+        if (m_mapped)
+            munmap(m_data, m_size);
+        else
+            std::free(m_data);
+        m_data = NULL;
+        m_size = 0;
+        m_mapped = false;
+    }
+
+    bool read_all(int fd) {
+        size_t capacity = 0;
+        for (;;) {
+            if (m_size == capacity) {
+                capacity = capacity == 0 ? IO_block_size : capacity*2;
+                unsigned char *data = (unsigned char *)std::realloc(m_data, capacity);
+                if (data == NULL)
+                    return false;
+                m_data = data;
+            }
+            ssize_t n = read(fd, m_data+m_size, capacity-m_size);
+            if (n < 0)
+                return false;
+            if (n == 0)
+                return true;
+            m_size += n;
+        }
+    }
+
+    MappedFile(const MappedFile &);
+    MappedFile &operator = (const MappedFile &);
+
+public:
+    MappedFile()
+        :m_data(NULL), m_size(0), m_mapped(false) {
+    }
+    ~MappedFile() {
+        close();
+    }
+
+    // Return false and set errno on failure
+    bool open(const char *path, int prot=PROT_READ, int advice=MADV_SEQUENTIAL) {
+        close();
+
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        bool ok;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *data = mmap(NULL, st.st_size, prot, MAP_PRIVATE, fd, 0);
+            ok = data != MAP_FAILED;
+            if (ok) {
+                m_data = (unsigned char *)data;
+                m_size = st.st_size;
+                m_mapped = true;
+                madvise(data, m_size, advice);
+            }
+        } else {
+            ok = read_all(fd);
+        }
+        ::close(fd);
+
+        if (!ok)
+            close();
+        return ok;
+    }
+
+    const unsigned char *data() const {
+        return m_data;
+    }
+    unsigned char *data() {
+        return m_data;
+    }
+    size_t size() const {
+        return m_size;
     }
 };
 
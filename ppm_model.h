@@ -1,53 +1,177 @@
 #ifndef _PPM_MODEL_H_
 #define _PPM_MODEL_H_
 
+#include <cerrno>
 #include <cstring>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
 
 #include "config.h"
 #include "buffer.h"
 #include "trie.h"
+#include "io_adapter.h"
 #include "arithmetic_encoder.h"
 #include "arithmetic_decoder.h"
+#include "range_encoder.h"
+#include "range_decoder.h"
+#include "entropy_encoder.h"
 
 struct PPMModel
 {
-    Trie m_contexts[Max_no_contexts+1];
+    MappedFile m_snapshot;      // The snapshot m_contexts is mapped on
+    Trie m_contexts;
     Buffer m_buffer;
-    int m_refcount;
+    mutable int m_refcount;     // Changed atomically, shared const
+                                // models are counted too
+    mutable PPMStats m_stats;   // Added to by the coders of the model,
+                                // scorers of shared const models too
+    bool m_frozen;              // Never updated again, see fork
+    const PPMModel *m_base;     // The model m_contexts overlays, NULL
+                                // for none
+
+    // order is the length of the longest contexts, from 1 to
+    // Max_order, see Trie::order
+    PPMModel(int max_frequency=Max_frequency, int order=Default_order)
+        :m_contexts(max_frequency, order), m_buffer(order), m_refcount(1),
+         m_frozen(false), m_base(NULL) {
+    }
 
-    PPMModel()
-        :m_refcount(1) {
+    ~PPMModel() {
+        if (m_base != NULL)
+            m_base->decref();
     }
 
-    void incref() {
-        ++m_refcount;
+    void incref() const {
+        __sync_add_and_fetch(&m_refcount, 1);
     }
-    void decref() {
-        if (--m_refcount == 0) {
+    void decref() const {
+        if (__sync_sub_and_fetch(&m_refcount, 1) == 0) {
             delete this;
         }
     }
     
+    int order() const {
+        return m_contexts.order();
+    }
+
     void update_contexts(symbol_t sym) {
-        int ictx = 1;
-        int offset = m_buffer.length() - 1;
-        while (offset >= 0) {
-            m_contexts[ictx].update_model(m_buffer, offset, sym);
-            offset--;
-            ictx++;
+        assert(!m_frozen);
+        m_contexts.update_model(m_buffer, sym);
+    }
+
+    // A model with a copy of the contexts of this one and an
+    // empty history
+    PPMModel *clone() const {
+        PPMModel *model = new PPMModel(m_contexts.max_frequency(), order());
+        model->m_contexts.copy(m_contexts);
+        model->m_base = m_base;
+        if (m_base != NULL)
+            m_base->incref();
+        return model;
+    }
+
+    // Forget all the contexts and the history, as a new model, or
+    // a new fork of the same base
+    void reset() {
+        assert(!m_frozen);
+        if (m_base != NULL)
+            m_contexts.overlay(&m_base->m_contexts);
+        else
+            m_contexts.reset();
+        m_buffer.reset();
+    }
+
+    // Promise that the contexts are never updated again, so that
+    // the model can be forked. It can still be scored, its index
+    // holds all the contexts it can for that, see
+    // Trie::fill_index.
+    void freeze() {
+        if (!m_frozen)
+            m_contexts.fill_index();
+        m_frozen = true;
+    }
+    bool frozen() const {
+        return m_frozen;
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// A model whose contexts overlay those of this frozen one,
+    /// see Trie::overlay, with an empty history. It learns as a
+    /// clone would, but only copies the contexts it updates, and
+    /// dropping it frees them all at once. Any number of forks,
+    /// on any threads, can share this model. A fork cannot be
+    /// dumped or forked.
+    ///
+    /// Return NULL and set errno to EINVAL if this model is not
+    /// frozen or is a fork.
+    ////////////////////////////////////////////////////////////
+    PPMModel *fork() const {
+        if (!m_frozen || m_base != NULL) {
+            errno = EINVAL;
+            return NULL;
         }
+        PPMModel *model = new PPMModel(m_contexts.max_frequency(), order());
+        model->m_contexts.overlay(&m_contexts);
+        model->m_base = this;
+        incref();
+        return model;
+    }
+
+    // Write a snapshot of the model, return false and set errno
+    // on failure
+    static bool dump(PPMModel *model, FILE *f) {
+        return model->m_contexts.dump(f) && fflush(f) == 0;
     }
 
-    static void dump(PPMModel *model, FILE *f) {
-        for (int i = 0; i < Max_no_contexts+1; ++i) {
-            model->m_contexts[i].dump(f);
+    // Write the snapshot to a temporary file renamed to path, so
+    // that models mapping the old file, possibly this one, keep
+    // working
+    static bool dump(PPMModel *model, const char *path) {
+        std::string tmp = std::string(path) + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (f == NULL)
+            return false;
+        bool ok = dump(model, f);
+        if (fclose(f) != 0)
+            ok = false;
+        if (ok && rename(tmp.c_str(), path) != 0)
+            ok = false;
+        if (!ok) {
+            int err = errno;
+            remove(tmp.c_str());
+            errno = err;
         }
+        return ok;
     }
-    static PPMModel *load(FILE *f) {
+
+    // Map the snapshot at path, the model gets the order of the
+    // one dumped. The pages are shared with other processes
+    // mapping the same file until the model is updated, which
+    // copies the touched pages. A model loaded read-only must
+    // never be updated. Loading takes the same time whatever the
+    // size of the snapshot: the index is left empty unless
+    // fill_index is set, or until freeze, as filling it touches
+    // every page and takes memory of its own, see
+    // Trie::fill_index. Return NULL and set errno on failure.
+    static PPMModel *load(const char *path, bool writable=true,
+                          bool fill_index=false) {
         PPMModel *model = new PPMModel();
-        for (int i = 0; i < Max_no_contexts+1; ++i) {
-            model->m_contexts[i].load(f);
+        int prot = writable ? PROT_READ|PROT_WRITE : PROT_READ;
+        if (!model->m_snapshot.open(path, prot, MADV_RANDOM)) {
+            delete model;
+            return NULL;
+        }
+        if (!model->m_contexts.map((char *)model->m_snapshot.data(),
+                                   model->m_snapshot.size())) {
+            delete model;
+            errno = EINVAL;
+            return NULL;
         }
+        model->m_buffer.set_order(model->order());
+        if (fill_index)
+            model->m_contexts.fill_index();
         return model;
     }
 };
@@ -66,31 +190,79 @@ public:
     }
 };
 
-template<typename Adapter, typename ContextUpdater>
+// The entropy coder used by PPMEncoder and PPMDecoder. The
+// max_frequency of a coder bounds the total count of a context
+// in the models it can code with.
+class ArithmeticCoder
+{
+public:
+    enum { max_frequency = Max_frequency };
+
+    template<typename Adapter>
+    struct Encoder {
+        typedef ArithmeticEncoder<Adapter> type;
+    };
+    template<typename Adapter>
+    struct Decoder {
+        typedef ArithmeticDecoder<Adapter> type;
+    };
+};
+class RangeCoder
+{
+public:
+    enum { max_frequency = Range_max_frequency };
+
+    template<typename Adapter>
+    struct Encoder {
+        typedef RangeEncoder<Adapter> type;
+    };
+    template<typename Adapter>
+    struct Decoder {
+        typedef RangeDecoder<Adapter> type;
+    };
+};
+
+// Scoring only: PPMScorer<CostAdapter, EntropyCoder> sums up
+// -log2 of the probabilities of the symbols in the CostAdapter
+// instead of coding them, so it can score any model.
+class EntropyCoder
+{
+public:
+    enum { max_frequency = Range_max_frequency };
+
+    template<typename Adapter>
+    struct Encoder {
+        typedef EntropyEncoder<Adapter> type;
+    };
+};
+
+template<typename Adapter, typename ContextUpdater,
+         typename Coder=ArithmeticCoder, typename Stats=DefaultStats>
 class PPMEncoder: public ContextUpdater
 {
 private:
-    ArithmeticEncoder<Adapter> *m_encoder;
+    typedef typename Coder::template Encoder<Adapter>::type Encoder;
+
+    Encoder *m_encoder;
     PPMModel *m_model;
-    
-    void uni_encode(wsymbol_t sym) {
-        m_encoder->encode(sym, sym+1, No_of_symbols);
-    }
+    Stats m_stats;
 
 public:
     PPMEncoder(Adapter &ad)
-        :m_encoder(new ArithmeticEncoder<Adapter>(ad)),
-         m_model(new PPMModel()) {
+        :m_encoder(new Encoder(ad)),
+         m_model(new PPMModel(Coder::max_frequency)) {
     }
 
     PPMEncoder(Adapter &ad, PPMModel *model)
-        :m_encoder(new ArithmeticEncoder<Adapter>(ad)),
+        :m_encoder(new Encoder(ad)),
          m_model(model) {
+        assert(m_model->m_contexts.max_frequency() <= Coder::max_frequency);
         m_model->incref();
     }
 
     ~PPMEncoder() {
         delete m_encoder;
+        m_stats.flush(m_model->m_stats);
         m_model->decref();
     }
 
@@ -103,98 +275,103 @@ public:
     }
     
     void encode(wsymbol_t sym) {
-        int ictx = m_model->m_buffer.length();
-
-        if (ictx == 0) {
-            uni_encode(sym);
-        } else {
-            
-            for (int i = 0; ictx > 0; --ictx, ++i) {
-                if (m_model->m_contexts[ictx].encode(m_encoder,
-                                                     m_model->m_buffer, i, sym)) {
-                    break;  // predict success
-                }
+        int order = m_model->m_contexts.find_context(m_model->m_buffer);
+
+        // Walk down the vine from the longest context
+        for (; order >= 0; --order) {
+            bool coded = m_model->m_contexts.encode(m_encoder, order, sym, m_stats);
+            m_stats.context(order, !coded);
+            if (coded) {
+                break;  // predict success
             }
+        }
 
-            if (ictx == 0)
-                uni_encode(sym);
+        if (order < 0) {
+            m_model->m_contexts.encode_uniform(m_encoder, sym);
+            m_stats.uniform();
         }
 
         if (sym != EOF_symbol) {
+            m_stats.update(m_model->m_contexts.cache_valid());
             this->do_context_update(m_model, sym);
             m_model->m_buffer << sym;
         }
     }
 
+    // Encode a span of bytes
+    void encode(const unsigned char *data, size_t size) {
+        for (const unsigned char *end = data+size; data != end; ++data)
+            encode(*data);
+    }
+
     void finish_encoding() {
         encode(EOF_symbol);
         m_encoder->finish_encoding();
     }
 };
 
-template<typename Adapter, typename ContextUpdater>
+template<typename Adapter, typename ContextUpdater,
+         typename Coder=ArithmeticCoder, typename Stats=DefaultStats>
 class PPMDecoder: public ContextUpdater
 {
 private:
-    ArithmeticDecoder<Adapter> *m_decoder;
+    typedef typename Coder::template Decoder<Adapter>::type Decoder;
+
+    Decoder *m_decoder;
     PPMModel *m_model;
-    
-    wsymbol_t uni_decode() {
-        code_value cum;
-        wsymbol_t sym;
-        cum = m_decoder->get_cum_freq(No_of_symbols);
-        assert(cum >= 0 && cum < No_of_symbols);
-        m_decoder->pop_symbol(cum, cum+1, No_of_symbols);
-        sym = cum;
+    Stats m_stats;
 
-        return sym;
-    }
-    
 public:
     PPMDecoder(Adapter &ad)
-        :m_decoder(new ArithmeticDecoder<Adapter>(ad)),
-         m_model(new PPMModel()) {
+        :m_decoder(new Decoder(ad)),
+         m_model(new PPMModel(Coder::max_frequency)) {
     }
 
     PPMDecoder(Adapter &ad, PPMModel *model)
-        :m_decoder(new ArithmeticDecoder<Adapter>(ad)),
+        :m_decoder(new Decoder(ad)),
          m_model(model) {
+        assert(m_model->m_contexts.max_frequency() <= Coder::max_frequency);
         m_model->incref();
     }
 
     ~PPMDecoder() {
         delete m_decoder;
+        m_stats.flush(m_model->m_stats);
         m_model->decref();
     }
 
     PPMModel *model() {
         return m_model;
     }
+
+    Decoder *decoder() {
+        return m_decoder;
+    }
     
     void start_decoding() {
         m_decoder->start_decoding();
     }
     
     wsymbol_t decode() {
-        int ictx = m_model->m_buffer.length();
-        wsymbol_t symbol;
-
-        if (ictx == 0) {
-            symbol = uni_decode();
-        } else {
-            for (int i = 0; ictx > 0; --ictx, ++i) {
-                symbol = m_model->m_contexts[ictx].decode(m_decoder,
-                                                          m_model->m_buffer, i);
-                if (symbol != ESC_symbol) {
-                    break;
-                }
+        int order = m_model->m_contexts.find_context(m_model->m_buffer);
+        wsymbol_t symbol = ESC_symbol;
+
+        // Walk down the vine from the longest context
+        for (; order >= 0; --order) {
+            symbol = m_model->m_contexts.decode(m_decoder, order, m_stats);
+            m_stats.context(order, symbol == ESC_symbol);
+            if (symbol != ESC_symbol) {
+                break;
             }
+        }
 
-            if (ictx == 0)
-                symbol = uni_decode();
+        if (order < 0) {
+            symbol = m_model->m_contexts.decode_uniform(m_decoder);
+            m_stats.uniform();
         }
 
         if (symbol != EOF_symbol) {
+            m_stats.update(m_model->m_contexts.cache_valid());
             this->do_context_update(m_model, symbol);
             m_model->m_buffer << symbol;
         }
@@ -207,4 +384,290 @@ public:
 };
 
 
+////////////////////////////////////////////////////////////
+// Encode with a model that is not modified, e.g. to see how
+// well it predicts some data. The history and the contexts
+// found live in the scorer, so several scorers can share one
+// model from different threads.
+////////////////////////////////////////////////////////////
+template<typename Adapter, typename Coder=ArithmeticCoder,
+         typename Stats=DefaultStats>
+class PPMScorer
+{
+private:
+    typedef typename Coder::template Encoder<Adapter>::type Encoder;
+
+    Encoder *m_encoder;
+    const PPMModel *m_model;
+    Buffer m_buffer;
+    TrieVine m_vine;
+    Stats m_stats;
+
+    PPMScorer(const PPMScorer &);
+    PPMScorer &operator = (const PPMScorer &);
+
+public:
+    PPMScorer(Adapter &ad, const PPMModel *model)
+        :m_encoder(new Encoder(ad)),
+         m_model(model),
+         m_buffer(model->order()) {
+        assert(m_model->m_contexts.max_frequency() <= Coder::max_frequency);
+        m_model->incref();
+    }
+
+    ~PPMScorer() {
+        delete m_encoder;
+        m_stats.flush(m_model->m_stats);
+        m_model->decref();
+    }
+
+    Encoder *encoder() {
+        return m_encoder;
+    }
+
+    void start_encoding() {
+        // Do nothing
+    }
+
+    // Encode sym, return the order of the context it is coded in,
+    // -1 for none, and set escapes to the contexts it escaped from
+    int encode(wsymbol_t sym, int &escapes) {
+        const Trie &contexts = m_model->m_contexts;
+        int order = contexts.find_context(m_buffer, m_vine);
+        int longest = order;
+
+        // Walk down the vine from the longest context
+        for (; order >= 0; --order) {
+            bool coded = contexts.encode(m_encoder, m_vine, order, sym, m_stats);
+            m_stats.context(order, !coded);
+            if (coded) {
+                break;  // predict success
+            }
+        }
+
+        if (order < 0) {
+            contexts.encode_uniform(m_encoder, sym);
+            m_stats.uniform();
+        }
+
+        if (sym != EOF_symbol)
+            m_buffer << sym;
+        escapes = longest-order;
+        return order;
+    }
+
+    void encode(wsymbol_t sym) {
+        int escapes;
+        encode(sym, escapes);
+    }
+
+    // Encode a span of bytes
+    void encode(const unsigned char *data, size_t size) {
+        for (const unsigned char *end = data+size; data != end; ++data)
+            encode(*data);
+    }
+
+    void finish_encoding() {
+        encode(EOF_symbol);
+        m_encoder->finish_encoding();
+    }
+};
+
+
+////////////////////////////////////////////////////////////
+// Training on a span of bytes, optionally with several
+// threads. Each thread trains a model of its own on one shard
+// of the data, the models are then merged into the trained
+// model. Contexts spanning two shards are not learned. The shard
+// models have the settings of the trained one, each with an equal
+// share of its memory limit.
+////////////////////////////////////////////////////////////
+
+struct PPMTrainShard
+{
+    PPMModel *model;
+    const unsigned char *data;
+    size_t size;
+    size_t output;              // Bytes the encoder would output
+};
+
+template<typename Coder>
+void *ppm_train_shard(void *arg)
+{
+    PPMTrainShard *shard = (PPMTrainShard *)arg;
+    NullOutputAdapter nad;
+
+    PPMEncoder<NullOutputAdapter, DefaultContextUpdater, Coder> penc(nad, shard->model);
+    penc.start_encoding();
+    penc.encode(shard->data, shard->size);
+    penc.finish_encoding();
+
+    shard->output = nad.count();
+    return NULL;
+}
+
+// Return the bytes the encoder would output, summed over the
+// shards
+inline size_t ppm_train(PPMModel *model, const unsigned char *data, size_t size,
+                        int threads=1)
+{
+    void *(*train_shard)(void *) =
+        model->m_contexts.max_frequency() <= ArithmeticCoder::max_frequency ?
+        ppm_train_shard<ArithmeticCoder> : ppm_train_shard<RangeCoder>;
+
+    if ((size_t)threads > size/Train_min_shard)
+        threads = size/Train_min_shard;
+    // The shards could not be merged into a fork
+    if (model->m_base != NULL)
+        threads = 1;
+    if (threads <= 1) {
+        PPMTrainShard shard = { model, data, size, 0 };
+        train_shard(&shard);
+        return shard.output;
+    }
+
+    std::vector<PPMTrainShard> shards(threads);
+    std::vector<pthread_t> tids(threads);
+    std::vector<bool> started(threads);
+    for (int i = 0; i < threads; ++i) {
+        size_t begin = size/threads*i;
+        size_t end = i == threads-1 ? size : size/threads*(i+1);
+        PPMTrainShard shard = {
+            new PPMModel(model->m_contexts.max_frequency(), model->order()),
+            data+begin, end-begin, 0
+        };
+        // As the model would learn, within a share of its limit
+        const Trie &contexts = model->m_contexts;
+        Trie &shard_contexts = shard.model->m_contexts;
+        if (contexts.memory_limit() != 0)
+            shard_contexts.set_memory_limit(contexts.memory_limit()/threads,
+                                            contexts.reclaim_policy());
+        shard_contexts.set_exclusion(contexts.exclusion());
+        shard_contexts.set_context_index(contexts.context_index());
+        shards[i] = shard;
+        started[i] = pthread_create(&tids[i], NULL, train_shard, &shards[i]) == 0;
+        if (!started[i])
+            train_shard(&shards[i]);
+    }
+
+    size_t output = 0;
+    for (int i = 0; i < threads; ++i) {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        model->m_contexts.merge(shards[i].model->m_contexts);
+        model->m_stats.add(shards[i].model->m_stats);
+        shards[i].model->decref();
+        output += shards[i].output;
+    }
+
+    // Go on from the end of the data as a serial training would
+    size_t order = model->order();
+    size_t tail = size < order ? size : order;
+    for (size_t i = size-tail; i < size; ++i)
+        model->m_buffer << data[i];
+    return output;
+}
+
+
+// Score every byte of data with model: costs[i] gets the bits of
+// data[i], orders[i] the order of the context it is coded in, 255
+// for none, and escapes[i] the contexts it escaped from. orders
+// and escapes may be NULL. Return the sum of the costs.
+inline double ppm_score_positions(const PPMModel *model, const unsigned char *data,
+                                  size_t size, float *costs,
+                                  unsigned char *orders, unsigned char *escapes)
+{
+    CostAdapter cad;
+    PPMScorer<CostAdapter, EntropyCoder> penc(cad, model);
+    penc.start_encoding();
+
+    double prev = 0;
+    for (size_t i = 0; i < size; ++i) {
+        int escaped;
+        int order = penc.encode(data[i], escaped);
+        penc.encoder()->finish_encoding();  // The bits of this byte
+        costs[i] = (float)(cad.bits()-prev);
+        prev = cad.bits();
+        if (orders != NULL)
+            orders[i] = order;
+        if (escapes != NULL)
+            escapes[i] = escaped;
+    }
+    return cad.bits();
+}
+
+
+// Run fn(arg) on threads threads, the calling one included, and
+// wait for all of them. Fewer threads run if they cannot be
+// created, so fn must share the work out by itself.
+inline void ppm_run_threads(void *(*fn)(void *), void *arg, int threads)
+{
+    std::vector<pthread_t> tids;
+    for (int i = 1; i < threads; ++i) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, fn, arg) == 0)
+            tids.push_back(tid);
+    }
+    fn(arg);
+    for (size_t i = 0; i < tids.size(); ++i)
+        pthread_join(tids[i], NULL);
+}
+
+
+////////////////////////////////////////////////////////////
+// Scoring many records with one model on several threads.
+// The threads take Score_batch_chunk records at a time, the
+// cost of a record is the number of bytes it encodes to.
+////////////////////////////////////////////////////////////
+
+struct PPMRecord
+{
+    const unsigned char *data;
+    size_t size;
+};
+
+struct PPMScoreBatch
+{
+    const PPMModel *model;
+    const PPMRecord *records;
+    size_t count;
+    int *costs;
+    size_t next;                // The first record no thread took yet
+};
+
+inline void *ppm_score_records(void *arg)
+{
+    PPMScoreBatch *batch = (PPMScoreBatch *)arg;
+    for (;;) {
+        size_t begin = __sync_fetch_and_add(&batch->next, Score_batch_chunk);
+        if (begin >= batch->count)
+            break;
+        size_t end = begin+Score_batch_chunk < batch->count ?
+            begin+Score_batch_chunk : batch->count;
+
+        for (size_t i = begin; i < end; ++i) {
+            NullOutputAdapter nad;
+            PPMScorer<NullOutputAdapter> penc(nad, batch->model);
+            penc.start_encoding();
+            penc.encode(batch->records[i].data, batch->records[i].size);
+            penc.finish_encoding();
+            batch->costs[i] = nad.count();
+        }
+    }
+    return NULL;
+}
+
+// Fill costs[i] with the cost of records[i]
+inline void ppm_score_batch(const PPMModel *model, const PPMRecord *records,
+                            size_t count, int *costs, int threads=1)
+{
+    PPMScoreBatch batch = { model, records, count, costs, 0 };
+
+    if ((size_t)threads > (count+Score_batch_chunk-1)/Score_batch_chunk)
+        threads = (count+Score_batch_chunk-1)/Score_batch_chunk;
+
+    ppm_run_threads(ppm_score_records, &batch, threads);
+}
+
+
 #endif /* _PPM_MODEL_H_ */
@@ -0,0 +1,112 @@
+#ifndef _PPM_STATS_H_
+#define _PPM_STATS_H_
+
+#include <cstring>
+#include <stdint.h>
+
+#include "config.h"
+
+////////////////////////////////////////////////////////////
+// Counters of the coding hot paths, kept in each model
+////////////////////////////////////////////////////////////
+struct PPMStats
+{
+    uint64_t m_coded[Max_order+1];    // Symbols tried in a context
+                                      // of each order
+    uint64_t m_escaped[Max_order+1];  // Escapes from each order
+    uint64_t m_uniform;         // Symbols coded in order -1
+    uint64_t m_list_searches;   // Contexts searched leaf by leaf
+    uint64_t m_leaves_scanned;  // Leaves visited by those searches
+    uint64_t m_table_searches;  // Contexts searched in a leaf table
+    uint64_t m_cache_hits;      // Updates along the contexts just coded
+    uint64_t m_cache_misses;    // Updates that had to find them again
+
+    PPMStats() {
+        memset(this, 0, sizeof(PPMStats));
+    }
+
+    // Add the counters of other, several threads may add at the
+    // same time
+    void add(const PPMStats &other) {
+        for (int i = 0; i <= Max_order; ++i) {
+            __sync_fetch_and_add(&m_coded[i], other.m_coded[i]);
+            __sync_fetch_and_add(&m_escaped[i], other.m_escaped[i]);
+        }
+        __sync_fetch_and_add(&m_uniform, other.m_uniform);
+        __sync_fetch_and_add(&m_list_searches, other.m_list_searches);
+        __sync_fetch_and_add(&m_leaves_scanned, other.m_leaves_scanned);
+        __sync_fetch_and_add(&m_table_searches, other.m_table_searches);
+        __sync_fetch_and_add(&m_cache_hits, other.m_cache_hits);
+        __sync_fetch_and_add(&m_cache_misses, other.m_cache_misses);
+    }
+};
+
+
+////////////////////////////////////////////////////////////
+// Stats policies of the coders and the trie. A coder counts
+// into its own policy object and adds the counts to its model
+// when it is destroyed.
+////////////////////////////////////////////////////////////
+
+// Count nothing, every call compiles away
+class NoStats
+{
+public:
+    enum { enabled = 0 };
+
+    void context(int, bool) {}
+    void uniform() {}
+    void list_search(int) {}
+    void table_search() {}
+    void update(bool) {}
+    void flush(PPMStats &) {}
+};
+
+class CountStats
+{
+private:
+    PPMStats m_counts;
+
+public:
+    enum { enabled = 1 };
+
+    // A symbol was tried in a context of order, and escaped or not
+    void context(int order, bool escaped) {
+        m_counts.m_coded[order]++;
+        if (escaped)
+            m_counts.m_escaped[order]++;
+    }
+    // A symbol escaped from all the contexts
+    void uniform() {
+        m_counts.m_uniform++;
+    }
+    void list_search(int leaves) {
+        m_counts.m_list_searches++;
+        m_counts.m_leaves_scanned += leaves;
+    }
+    void table_search() {
+        m_counts.m_table_searches++;
+    }
+    // The model is updated, with the contexts found for coding
+    // still valid or not
+    void update(bool cached) {
+        if (cached)
+            m_counts.m_cache_hits++;
+        else
+            m_counts.m_cache_misses++;
+    }
+    void flush(PPMStats &stats) {
+        stats.add(m_counts);
+        m_counts = PPMStats();
+    }
+};
+
+// The policy of the coders unless they are given one, build with
+// -DPPM_STATS to count
+#ifdef PPM_STATS
+typedef CountStats DefaultStats;
+#else
+typedef NoStats DefaultStats;
+#endif
+
+#endif /* _PPM_STATS_H_ */
@@ -1,18 +1,76 @@
 #include <cstdio>
 #include <cstring>
 #include <cerrno>
+#include <vector>
 #include <Python.h>
 #include "ppm_model.h"
 #include "io_adapter.h"
+#include "block_container.h"
 
 using namespace std;
 
+// A decompressobj decodes only while this many input bytes are
+// buffered, more than a symbol with all its escapes can take
+#define Stream_lookahead 64
+
+////////////////////////////////////////////////////////////
+// Write the output straight into a Python string, doubling it
+// when full. If it cannot grow, the rest of the output is
+// dropped and MemoryError is set.
+////////////////////////////////////////////////////////////
+class StringOutputAdapter
+{
+private:
+    PyObject *m_str;
+    size_t m_size;
+    size_t m_capacity;
+
+    bool grow() {
+        if (m_str == NULL)
+            return false;
+        m_capacity *= 2;
+        return _PyString_Resize(&m_str, m_capacity) == 0;
+    }
+
+    StringOutputAdapter(const StringOutputAdapter &);
+    StringOutputAdapter &operator = (const StringOutputAdapter &);
+
+public:
+    StringOutputAdapter(size_t capacity)
+        :m_size(0), m_capacity(capacity < 64 ? 64 : capacity) {
+        m_str = PyString_FromStringAndSize(NULL, m_capacity);
+    }
+    ~StringOutputAdapter() {
+        Py_XDECREF(m_str);
+    }
+
+    void operator() (int ch) {
+        if (m_size == m_capacity && !grow())
+            return;
+        PyString_AS_STRING(m_str)[m_size++] = (char)ch;
+    }
+
+    void flush() {
+    }
+
+    // Return the string cut to the output and give it up, NULL
+    // if it could not be allocated
+    PyObject *release() {
+        if (m_str != NULL && _PyString_Resize(&m_str, m_size) != 0)
+            return NULL;
+        PyObject *res = m_str;
+        m_str = NULL;
+        return res;
+    }
+};
+
 extern "C" {
     
 typedef struct 
 {
     PyObject_HEAD
     PPMModel *model;
+    int readers;                // Batches scoring without the GIL
 } Model;
 
 static void Model_dealloc(PyObject *self);
@@ -33,32 +91,71 @@ static PyTypeObject Model_Type = {
 #define Model_Check(v) ((v)->ob_type == &Model_Type)
 #define Model_Ptr(v)   (((Model *)(v))->model)
 
+// The model must not change while it is scored without the GIL,
+// or once it is frozen
+static bool Model_Writable(PyObject *self)
+{
+    if (((Model *)self)->readers > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "model is being scored");
+        return false;
+    }
+    if (Model_Ptr(self)->frozen()) {
+        PyErr_SetString(PyExc_RuntimeError, "model is frozen");
+        return false;
+    }
+    return true;
+}
+
+// Threads to use when the caller passes 0 or less
+static int default_threads(int threads)
+{
+    return threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// Model([path[, order]]): the snapshot at path, or a new model of
+// the given order if path is None
 static PyObject *Model_New(PyObject *self, PyObject *args) 
 {
     PPMModel *pm;
     Model *model = NULL;
     char *path = NULL;
+    int order = Default_order;
 
-    if (PyArg_ParseTuple(args, "|s", &path)) {
+    if (PyArg_ParseTuple(args, "|zi", &path, &order)) {
+        if (order < 1 || order > Max_order) {
+            PyErr_Format(PyExc_ValueError, "order must be from 1 to %d", Max_order);
+            return NULL;
+        }
         if (path != NULL) {
-            FILE *fp = fopen(path, "rb");
-            if (fp == NULL) {
+            pm = PPMModel::load(path);
+            if (pm == NULL) {
                 PyErr_SetString(PyExc_IOError, strerror(errno));
                 return (PyObject *)model;
-            } else {
-                pm = PPMModel::load(fp);
-                fclose(fp);
             }
         } else {
-            pm = new PPMModel();
+            pm = new PPMModel(Max_frequency, order);
         }        
         model = PyObject_New(Model, &Model_Type);
         model->model = pm;
+        model->readers = 0;
     }
 
     return (PyObject *)model;
 }
 
+// A Python model for pm, which it takes over
+static PyObject *Model_Wrap(PPMModel *pm)
+{
+    Model *model = PyObject_New(Model, &Model_Type);
+    if (model == NULL) {
+        pm->decref();
+        return NULL;
+    }
+    model->model = pm;
+    model->readers = 0;
+    return (PyObject *)model;
+}
+
 static void Model_dealloc(PyObject *self) 
 {
     Model_Ptr(self)->decref();
@@ -68,75 +165,487 @@ static void Model_dealloc(PyObject *self)
 static PyObject *Model_dump(PyObject *self, PyObject *args) 
 {
     char *path = NULL;
-    
-    if (PyArg_ParseTuple(args, "s", &path)) {
-        FILE *fp = fopen(path, "wb");
-        if (fp == NULL) {
-            PyErr_SetString(PyExc_IOError, strerror(errno));
-        } else {
-            PPMModel::dump(Model_Ptr(self), fp);
-            fclose(fp);
-        }
+
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+    if (!PPMModel::dump(Model_Ptr(self), path)) {
+        PyErr_SetString(PyExc_IOError, strerror(errno));
+        return NULL;
     }
-    
     return Py_BuildValue("");
 }
 
+// reset() forgets all that the model learned
+static PyObject *Model_reset(PyObject *self, PyObject *args)
+{
+    if (!Model_Writable(self))
+        return NULL;
+    Model_Ptr(self)->reset();
+    return Py_BuildValue("");
+}
+
+// freeze() makes the model read-only and shareable by fork(), and
+// fills the index of a loaded model for scoring
+static PyObject *Model_freeze(PyObject *self, PyObject *args)
+{
+    if (!Model_Writable(self))
+        return NULL;
+    Model_Ptr(self)->freeze();
+    return Py_BuildValue("");
+}
+
+// fork() returns a new model over the frozen contexts of this one,
+// which learns on its own without copying them
+static PyObject *Model_fork(PyObject *self, PyObject *args)
+{
+    if (!Model_Ptr(self)->frozen()) {
+        PyErr_SetString(PyExc_RuntimeError, "model is not frozen");
+        return NULL;
+    }
+    PPMModel *pm = Model_Ptr(self)->fork();
+    if (pm == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot fork a fork");
+        return NULL;
+    }
+    return Model_Wrap(pm);
+}
+
 static PyObject *Model_train(PyObject *self, PyObject *args)
 {
     char *path = NULL;
+    int threads = 1;
 
-    if (PyArg_ParseTuple(args, "s", &path)) {
-        FILE *fp = fopen(path, "rb");
-        if (fp == NULL) {
-            PyErr_SetString(PyExc_IOError, strerror(errno));
-        } else {
-            NullOutputAdapter nad;
+    if (!PyArg_ParseTuple(args, "s|i", &path, &threads) || !Model_Writable(self))
+        return NULL;
 
-            PPMEncoder<NullOutputAdapter, DefaultContextUpdater> penc(nad, Model_Ptr(self));
-            penc.start_encoding();
-            for (int ch = fgetc(fp); ch != EOF; ch = fgetc(fp)) {
-                penc.encode(ch);
-            }
-            penc.finish_encoding();
-            fclose(fp);
-            
-            return Py_BuildValue("i", nad.count());
-        }
+    MappedFile file;
+    if (!file.open(path)) {
+        PyErr_SetString(PyExc_IOError, strerror(errno));
+        return NULL;
     }
-    return Py_BuildValue("");
+    size_t output = ppm_train(Model_Ptr(self), file.data(), file.size(), threads);
+    return Py_BuildValue("n", (Py_ssize_t)output);
 }
 
 static PyObject *Model_predict(PyObject *self, PyObject *args)
 {
     char *path = NULL;
 
-    if (PyArg_ParseTuple(args, "s", &path)) {
-        FILE *fp = fopen(path, "rb");
-        if (fp == NULL) {
-            PyErr_SetString(PyExc_IOError, strerror(errno));
-        } else {
-            NullOutputAdapter nad;
-
-            PPMModel *pm = Model_Ptr(self);
-            pm->m_buffer.reset();
-            PPMEncoder<NullOutputAdapter, NopeContextUpdater> penc(nad, pm);
-            penc.start_encoding();
-            for (int ch = fgetc(fp); ch != EOF; ch = fgetc(fp))
-                penc.encode(ch);
-            penc.finish_encoding();
-            fclose(fp);
-
-            return Py_BuildValue("i", nad.count());
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+
+    MappedFile file;
+    if (!file.open(path)) {
+        PyErr_SetString(PyExc_IOError, strerror(errno));
+        return NULL;
+    }
+    NullOutputAdapter nad;
+
+    PPMScorer<NullOutputAdapter> penc(nad, Model_Ptr(self));
+    penc.start_encoding();
+    penc.encode(file.data(), file.size());
+    penc.finish_encoding();
+
+    return Py_BuildValue("i", nad.count());
+}
+
+// Set the memory limit of a model from Python arguments, policy
+// may be NULL. Return false with the exception set on failure.
+static bool set_memory_limit(PPMModel *model, Py_ssize_t limit, const char *policy)
+{
+    int p = Trie::Prune;
+    if (policy != NULL) {
+        if (strcmp(policy, "restart") == 0) {
+            p = Trie::Restart;
+        } else if (strcmp(policy, "prune") != 0) {
+            PyErr_SetString(PyExc_ValueError, "policy must be 'prune' or 'restart'");
+            return false;
         }
     }
+    if (limit < 0) {
+        PyErr_SetString(PyExc_ValueError, "limit must not be negative");
+        return false;
+    }
+
+    model->m_contexts.set_memory_limit(limit, p);
+    return true;
+}
+
+static PyObject *Model_set_memory_limit(PyObject *self, PyObject *args)
+{
+    Py_ssize_t limit;
+    char *policy = NULL;
+
+    // The limit may drop the index, which scorers may be reading
+    if (!PyArg_ParseTuple(args, "n|s", &limit, &policy) || !Model_Writable(self) ||
+        !set_memory_limit(Model_Ptr(self), limit, policy))
+        return NULL;
+    return Py_BuildValue("");
+}
+
+// Whether the symbols of the contexts escaped from are left out
+// of the shorter ones, models coding the same data must agree
+static PyObject *Model_set_exclusion(PyObject *self, PyObject *args)
+{
+    int exclusion;
+
+    if (!PyArg_ParseTuple(args, "i", &exclusion) || !Model_Writable(self))
+        return NULL;
+    Model_Ptr(self)->m_contexts.set_exclusion(exclusion != 0);
+    return Py_BuildValue("");
+}
+
+// Whether contexts are looked up in a hashed index, see
+// Trie::set_context_index. The coding is the same either way.
+static PyObject *Model_set_context_index(PyObject *self, PyObject *args)
+{
+    int indexed;
+
+    if (!PyArg_ParseTuple(args, "i", &indexed) || !Model_Writable(self))
+        return NULL;
+    Model_Ptr(self)->m_contexts.set_context_index(indexed != 0);
     return Py_BuildValue("");
 }
 
+static PyObject *Model_memory(PyObject *self, PyObject *args)
+{
+    const Trie &t = Model_Ptr(self)->m_contexts;
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n}",
+                         "memory", (Py_ssize_t)t.memory(),
+                         "index", (Py_ssize_t)t.index_memory(),
+                         "limit", (Py_ssize_t)t.memory_limit(),
+                         "contexts", (Py_ssize_t)t.no_of_contexts(),
+                         "reclaims", (Py_ssize_t)t.reclaims(),
+                         "reclaimed_contexts", (Py_ssize_t)t.reclaimed_contexts());
+}
+
+// A list of the first n counters
+static PyObject *counter_list(const uint64_t *counters, int n)
+{
+    PyObject *list = PyList_New(n);
+    for (int i = 0; list != NULL && i < n; ++i) {
+        PyObject *item = PyLong_FromUnsignedLongLong(counters[i]);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+// The shape of the model, and the counters of the coders if the
+// module is built with -DPPM_STATS. Lists are indexed by order,
+// uniform is the symbols coded with no context.
+static PyObject *Model_stats(PyObject *self, PyObject *args)
+{
+    const PPMModel *pm = Model_Ptr(self);
+    const PPMStats &s = pm->m_stats;
+    TrieCensus c;
+    pm->m_contexts.census(c);
+    int order = pm->order();
+    uint64_t contexts[Max_order+1];
+    for (int i = 0; i <= order; ++i)
+        contexts[i] = c.m_contexts[i];
+
+    return Py_BuildValue("{s:i,s:N,s:n,s:n,s:n,s:{s:n,s:n,s:n,s:n},s:n,s:n,"
+                         "s:i,s:N,s:N,s:K,s:K,s:K,s:K,s:K,s:K}",
+                         "order", order,
+                         "contexts", counter_list(contexts, order+1),
+                         "leaves", (Py_ssize_t)c.m_leaves,
+                         "leaf_tables", (Py_ssize_t)c.m_leaf_tables,
+                         "child_tables", (Py_ssize_t)c.m_child_tables,
+                         "blocks",
+                         "nodes", (Py_ssize_t)c.m_blocks[0],
+                         "leaves", (Py_ssize_t)c.m_blocks[1],
+                         "leaf_tables", (Py_ssize_t)c.m_blocks[2],
+                         "child_tables", (Py_ssize_t)c.m_blocks[3],
+                         "memory", (Py_ssize_t)pm->m_contexts.memory(),
+                         "rescales", (Py_ssize_t)pm->m_contexts.rescales(),
+                         "counting", (int)DefaultStats::enabled,
+                         "coded", counter_list(s.m_coded, order+1),
+                         "escaped", counter_list(s.m_escaped, order+1),
+                         "uniform", (unsigned long long)s.m_uniform,
+                         "list_searches", (unsigned long long)s.m_list_searches,
+                         "leaves_scanned", (unsigned long long)s.m_leaves_scanned,
+                         "table_searches", (unsigned long long)s.m_table_searches,
+                         "cache_hits", (unsigned long long)s.m_cache_hits,
+                         "cache_misses", (unsigned long long)s.m_cache_misses);
+}
+
+static PyObject *Model_train_bytes(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+    int threads = 1;
+
+    if (!PyArg_ParseTuple(args, "s*|i", &data, &threads))
+        return NULL;
+    if (!Model_Writable(self)) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+
+    size_t output = ppm_train(Model_Ptr(self), (const unsigned char *)data.buf,
+                              data.len, threads);
+    PyBuffer_Release(&data);
+    return Py_BuildValue("n", (Py_ssize_t)output);
+}
+
+static PyObject *Model_score(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+
+    if (!PyArg_ParseTuple(args, "s*", &data))
+        return NULL;
+
+    NullOutputAdapter nad;
+    {
+        PPMScorer<NullOutputAdapter> penc(nad, Model_Ptr(self));
+        penc.start_encoding();
+        penc.encode((const unsigned char *)data.buf, data.len);
+        penc.finish_encoding();
+    }
+    PyBuffer_Release(&data);
+    return Py_BuildValue("i", nad.count());
+}
+
+// Like predict and score, but the cost is the exact sum of -log2
+// of the probabilities of the bytes and the end, in bits
+static PyObject *Model_predict_bits(PyObject *self, PyObject *args)
+{
+    char *path = NULL;
+
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+    MappedFile file;
+    if (!file.open(path)) {
+        PyErr_SetString(PyExc_IOError, strerror(errno));
+        return NULL;
+    }
+
+    CostAdapter cad;
+    {
+        PPMScorer<CostAdapter, EntropyCoder> penc(cad, Model_Ptr(self));
+        penc.start_encoding();
+        penc.encode(file.data(), file.size());
+        penc.finish_encoding();
+    }
+    return Py_BuildValue("d", cad.bits());
+}
+
+static PyObject *Model_score_bits(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+
+    if (!PyArg_ParseTuple(args, "s*", &data))
+        return NULL;
+
+    CostAdapter cad;
+    {
+        PPMScorer<CostAdapter, EntropyCoder> penc(cad, Model_Ptr(self));
+        penc.start_encoding();
+        penc.encode((const unsigned char *)data.buf, data.len);
+        penc.finish_encoding();
+    }
+    PyBuffer_Release(&data);
+    return Py_BuildValue("d", cad.bits());
+}
+
+// Writable memory of a caller's object for n items of itemsize
+// bytes. Objects with the new buffer protocol, such as numpy
+// arrays, must also have the format. Old-style buffers such as
+// array.array are only checked for size. Release with release().
+class OutputBuffer
+{
+private:
+    Py_buffer m_view;
+    bool m_view_held;
+
+    OutputBuffer(const OutputBuffer &);
+    OutputBuffer &operator = (const OutputBuffer &);
+
+public:
+    void *m_data;
+
+    OutputBuffer()
+        :m_view_held(false), m_data(NULL) {
+    }
+    ~OutputBuffer() {
+        release();
+    }
+
+    // Return false with the exception set on failure
+    bool get(PyObject *obj, Py_ssize_t n, Py_ssize_t itemsize, const char *format,
+             const char *name) {
+        Py_ssize_t len;
+        if (PyObject_CheckBuffer(obj)) {
+            if (PyObject_GetBuffer(obj, &m_view, PyBUF_WRITABLE|PyBUF_FORMAT) != 0)
+                return false;
+            m_view_held = true;
+            if (m_view.itemsize != itemsize ||
+                (m_view.format != NULL && strcmp(m_view.format, format) != 0)) {
+                PyErr_Format(PyExc_TypeError, "%s must hold items of format '%s'",
+                             name, format);
+                return false;
+            }
+            m_data = m_view.buf;
+            len = m_view.len;
+        } else if (PyObject_AsWriteBuffer(obj, &m_data, &len) != 0) {
+            return false;
+        }
+        if (len < n*itemsize) {
+            PyErr_Format(PyExc_ValueError, "%s must have room for %zd items", name, n);
+            return false;
+        }
+        return true;
+    }
+
+    void release() {
+        if (m_view_held)
+            PyBuffer_Release(&m_view);
+        m_view_held = false;
+    }
+};
+
+// score_positions(data, costs[, orders[, escapes]]) fills costs,
+// float32 items, with the bits of every byte of data as in
+// score_bits, and orders and escapes, uint8 items, with the order
+// of the context each byte is coded in, 255 for none, and the
+// contexts it escaped from. Return the sum of the costs.
+static PyObject *Model_score_positions(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+    PyObject *costs_obj, *orders_obj = Py_None, *escapes_obj = Py_None;
+
+    if (!PyArg_ParseTuple(args, "s*O|OO", &data, &costs_obj, &orders_obj, &escapes_obj))
+        return NULL;
+
+    OutputBuffer costs, orders, escapes;
+    double bits = 0;
+    bool ok = costs.get(costs_obj, data.len, sizeof(float), "f", "costs") &&
+        (orders_obj == Py_None || orders.get(orders_obj, data.len, 1, "B", "orders")) &&
+        (escapes_obj == Py_None || escapes.get(escapes_obj, data.len, 1, "B", "escapes"));
+    if (ok)
+        bits = ppm_score_positions(Model_Ptr(self), (const unsigned char *)data.buf, data.len,
+                                   (float *)costs.m_data,
+                                   (unsigned char *)orders.m_data,
+                                   (unsigned char *)escapes.m_data);
+    PyBuffer_Release(&data);
+    if (!ok)
+        return NULL;
+    return Py_BuildValue("d", bits);
+}
+
+// Batch scoring: score_batch(records[, None, threads]) with a
+// sequence of buffers, or score_batch(data, offsets[, threads])
+// where record i is data[offsets[i]:offsets[i+1]]. The records
+// are scored in parallel without the GIL, the costs come back
+// in an array('i').
+static PyObject *Model_score_batch(PyObject *self, PyObject *args)
+{
+    PyObject *records, *offsets = Py_None;
+    int threads = 0;
+
+    if (!PyArg_ParseTuple(args, "O|Oi", &records, &offsets, &threads))
+        return NULL;
+    threads = default_threads(threads);
+
+    std::vector<Py_buffer> buffers;
+    std::vector<PPMRecord> recs;
+    bool ok = true;
+
+    if (offsets == Py_None) {
+        PyObject *seq = PySequence_Fast(records, "records must be a sequence of buffers");
+        if (seq == NULL)
+            return NULL;
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+        buffers.reserve(n);
+        for (Py_ssize_t i = 0; i < n && ok; ++i) {
+            Py_buffer buf;
+            ok = PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i), &buf, PyBUF_SIMPLE) == 0;
+            if (ok) {
+                buffers.push_back(buf);
+                PPMRecord r = { (const unsigned char *)buf.buf, (size_t)buf.len };
+                recs.push_back(r);
+            }
+        }
+        Py_DECREF(seq);
+    } else {
+        Py_buffer buf;
+        if (PyObject_GetBuffer(records, &buf, PyBUF_SIMPLE) != 0)
+            return NULL;
+        buffers.push_back(buf);
+
+        PyObject *seq = PySequence_Fast(offsets, "offsets must be a sequence of integers");
+        ok = seq != NULL;
+        Py_ssize_t n = ok ? PySequence_Fast_GET_SIZE(seq) : 0;
+        Py_ssize_t prev = 0;
+        for (Py_ssize_t i = 0; i < n && ok; ++i) {
+            Py_ssize_t off = PyNumber_AsSsize_t(PySequence_Fast_GET_ITEM(seq, i), PyExc_OverflowError);
+            if (off == -1 && PyErr_Occurred()) {
+                ok = false;
+            } else if (off < prev || off > buf.len) {
+                PyErr_SetString(PyExc_ValueError, "offsets must be ascending within the data");
+                ok = false;
+            } else if (i > 0) {
+                PPMRecord r = { (const unsigned char *)buf.buf + prev, (size_t)(off-prev) };
+                recs.push_back(r);
+            }
+            prev = off;
+        }
+        Py_XDECREF(seq);
+    }
+
+    std::vector<int> costs(recs.size());
+    if (ok && !recs.empty()) {
+        Model *model = (Model *)self;
+        model->readers++;
+        Py_BEGIN_ALLOW_THREADS
+        ppm_score_batch(model->model, &recs[0], recs.size(), &costs[0], threads);
+        Py_END_ALLOW_THREADS
+        model->readers--;
+    }
+    for (size_t i = 0; i < buffers.size(); ++i)
+        PyBuffer_Release(&buffers[i]);
+    if (!ok)
+        return NULL;
+
+    PyObject *array = PyImport_ImportModule("array");
+    if (array == NULL)
+        return NULL;
+    PyObject *res = PyObject_CallMethod(array, (char *)"array", (char *)"s", "i");
+    Py_DECREF(array);
+    if (res != NULL && !costs.empty()) {
+        PyObject *r = PyObject_CallMethod(res, (char *)"fromstring", (char *)"s#",
+                                          (const char *)&costs[0],
+                                          (int)(costs.size()*sizeof(int)));
+        if (r == NULL) {
+            Py_DECREF(res);
+            return NULL;
+        }
+        Py_DECREF(r);
+    }
+    return res;
+}
+
 static PyMethodDef Model_methods[] = {
     {"dump", Model_dump, METH_VARARGS},
     {"train", Model_train, METH_VARARGS},
     {"predict", Model_predict, METH_VARARGS},
+    {"train_bytes", Model_train_bytes, METH_VARARGS},
+    {"score", Model_score, METH_VARARGS},
+    {"predict_bits", Model_predict_bits, METH_VARARGS},
+    {"score_bits", Model_score_bits, METH_VARARGS},
+    {"score_positions", Model_score_positions, METH_VARARGS},
+    {"score_batch", Model_score_batch, METH_VARARGS},
+    {"set_memory_limit", Model_set_memory_limit, METH_VARARGS},
+    {"set_exclusion", Model_set_exclusion, METH_VARARGS},
+    {"set_context_index", Model_set_context_index, METH_VARARGS},
+    {"memory", Model_memory, METH_VARARGS},
+    {"stats", Model_stats, METH_VARARGS},
+    {"reset", Model_reset, METH_VARARGS},
+    {"freeze", Model_freeze, METH_VARARGS},
+    {"fork", Model_fork, METH_VARARGS},
     {NULL, NULL},
 };
 
@@ -145,8 +654,512 @@ static PyObject * Model_GetAttr(PyObject *self, char *attrname)
     return Py_FindMethod(Model_methods, self, attrname);
 }
     
+static PyObject *compress(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+
+    if (!PyArg_ParseTuple(args, "s*", &data))
+        return NULL;
+
+    StringOutputAdapter sad(data.len/2 + 64);
+    {
+        PPMEncoder<StringOutputAdapter, DefaultContextUpdater> penc(sad);
+        penc.start_encoding();
+        penc.encode((const unsigned char *)data.buf, data.len);
+        penc.finish_encoding();
+    }
+    PyBuffer_Release(&data);
+    return sad.release();
+}
+
+static PyObject *decompress(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+
+    if (!PyArg_ParseTuple(args, "s*", &data))
+        return NULL;
+
+    MemoryInputAdapter mad((const unsigned char *)data.buf, data.len);
+    StringOutputAdapter sad(data.len*4);
+    bool corrupt = false;
+    {
+        PPMDecoder<MemoryInputAdapter, DefaultContextUpdater> pdec(mad);
+        pdec.start_decoding();
+        for (;;) {
+            wsymbol_t sym = pdec.decode();
+            if (sym == EOF_symbol)
+                break;
+            if (mad.overrun() > Decode_max_overrun) {
+                corrupt = true;
+                break;
+            }
+            sad(sym);
+        }
+        pdec.finish_decoding();
+    }
+    PyBuffer_Release(&data);
+
+    if (corrupt) {
+        PyErr_SetString(PyExc_ValueError, "truncated or corrupt data");
+        return NULL;
+    }
+    return sad.release();
+}
+
+//====================================================================
+// Streaming objects, as zlib.compressobj and zlib.decompressobj.
+// Each holds a live coder with a model of its own, optionally
+// limited in memory. Flushing ends the stream. The data fed to a
+// decompressor past the end of the stream is in its unused_data.
+//====================================================================
+
+typedef PPMEncoder<MemoryOutputAdapter, DefaultContextUpdater> StreamEncoder;
+typedef PPMDecoder<StreamInputAdapter, DefaultContextUpdater> StreamDecoder;
+
+typedef struct
+{
+    PyObject_HEAD
+    MemoryOutputAdapter *output;
+    StreamEncoder *encoder;     // NULL once flushed
+} Compressor;
+
+typedef struct
+{
+    PyObject_HEAD
+    StreamInputAdapter *input;  // Once the EOF is decoded, the data
+                                // past the end of the stream
+    StreamDecoder *decoder;     // NULL once the EOF is decoded
+    bool started;
+} Decompressor;
+
+static void Compressor_dealloc(PyObject *self);
+static PyObject *Compressor_GetAttr(PyObject *self, char *attrname);
+static void Decompressor_dealloc(PyObject *self);
+static PyObject *Decompressor_GetAttr(PyObject *self, char *attrname);
+
+static PyTypeObject Compressor_Type = {
+    PyObject_HEAD_INIT(&PyType_Type)
+    0,
+    "Compressor",
+    sizeof(Compressor),
+    0,
+    (destructor)Compressor_dealloc,
+    0,
+    (getattrfunc)Compressor_GetAttr,
+    /* rest are NULLs */
+};
+
+static PyTypeObject Decompressor_Type = {
+    PyObject_HEAD_INIT(&PyType_Type)
+    0,
+    "Decompressor",
+    sizeof(Decompressor),
+    0,
+    (destructor)Decompressor_dealloc,
+    0,
+    (getattrfunc)Decompressor_GetAttr,
+    /* rest are NULLs */
+};
+
+static PyObject *compressobj(PyObject *self, PyObject *args)
+{
+    Py_ssize_t limit = 0;
+    char *policy = NULL;
+
+    if (!PyArg_ParseTuple(args, "|ns", &limit, &policy))
+        return NULL;
+
+    MemoryOutputAdapter *output = new MemoryOutputAdapter();
+    StreamEncoder *encoder = new StreamEncoder(*output);
+    if (!set_memory_limit(encoder->model(), limit, policy)) {
+        delete encoder;
+        delete output;
+        return NULL;
+    }
+    encoder->start_encoding();
+
+    Compressor *c = PyObject_New(Compressor, &Compressor_Type);
+    if (c == NULL) {
+        delete encoder;
+        delete output;
+        return NULL;
+    }
+    c->output = output;
+    c->encoder = encoder;
+    return (PyObject *)c;
+}
+
+static void Compressor_dealloc(PyObject *self)
+{
+    Compressor *c = (Compressor *)self;
+    delete c->encoder;
+    delete c->output;
+    PyObject_Del(self);
+}
+
+// Hand the output so far over to a string
+static PyObject *Compressor_take_output(Compressor *c)
+{
+    PyObject *res = PyString_FromStringAndSize((const char *)c->output->data(),
+                                               c->output->size());
+    c->output->clear();
+    return res;
+}
+
+static PyObject *Compressor_compress(PyObject *self, PyObject *args)
+{
+    Compressor *c = (Compressor *)self;
+    Py_buffer data;
+
+    if (!PyArg_ParseTuple(args, "s*", &data))
+        return NULL;
+    if (c->encoder == NULL) {
+        PyBuffer_Release(&data);
+        PyErr_SetString(PyExc_ValueError, "compressor is flushed");
+        return NULL;
+    }
+
+    c->encoder->encode((const unsigned char *)data.buf, data.len);
+    PyBuffer_Release(&data);
+    return Compressor_take_output(c);
+}
+
+static PyObject *Compressor_flush(PyObject *self, PyObject *args)
+{
+    Compressor *c = (Compressor *)self;
+
+    if (c->encoder != NULL) {
+        c->encoder->finish_encoding();
+        delete c->encoder;
+        c->encoder = NULL;
+    }
+    return Compressor_take_output(c);
+}
+
+static PyMethodDef Compressor_methods[] = {
+    {"compress", Compressor_compress, METH_VARARGS},
+    {"flush", Compressor_flush, METH_VARARGS},
+    {NULL, NULL},
+};
+
+static PyObject *Compressor_GetAttr(PyObject *self, char *attrname)
+{
+    return Py_FindMethod(Compressor_methods, self, attrname);
+}
+
+static PyObject *decompressobj(PyObject *self, PyObject *args)
+{
+    Py_ssize_t limit = 0;
+    char *policy = NULL;
+
+    if (!PyArg_ParseTuple(args, "|ns", &limit, &policy))
+        return NULL;
+
+    StreamInputAdapter *input = new StreamInputAdapter();
+    StreamDecoder *decoder = new StreamDecoder(*input);
+    if (!set_memory_limit(decoder->model(), limit, policy)) {
+        delete decoder;
+        delete input;
+        return NULL;
+    }
+
+    Decompressor *d = PyObject_New(Decompressor, &Decompressor_Type);
+    if (d == NULL) {
+        delete decoder;
+        delete input;
+        return NULL;
+    }
+    d->input = input;
+    d->decoder = decoder;
+    d->started = false;
+    return (PyObject *)d;
+}
+
+static void Decompressor_dealloc(PyObject *self)
+{
+    Decompressor *d = (Decompressor *)self;
+    delete d->decoder;
+    delete d->input;
+    PyObject_Del(self);
+}
+
+// Decode while at least lookahead bytes are buffered, until the
+// EOF. Return false on corrupt input.
+static bool Decompressor_run(Decompressor *d, size_t lookahead,
+                             StringOutputAdapter &sad)
+{
+    if (d->decoder == NULL)
+        return true;
+    if (!d->started) {
+        if (d->input->available() < lookahead)
+            return true;
+        d->decoder->start_decoding();
+        d->started = true;
+    }
+
+    while (d->input->available() >= lookahead) {
+        wsymbol_t sym = d->decoder->decode();
+        if (sym == EOF_symbol) {
+            // Give back the bytes the decoder read past the end
+            size_t ahead = d->decoder->decoder()->read_ahead();
+            size_t overrun = d->input->overrun();
+            d->input->unread(ahead > overrun ? ahead-overrun : 0);
+            d->decoder->finish_decoding();
+            delete d->decoder;
+            d->decoder = NULL;
+            break;
+        }
+        if (d->input->overrun() > Decode_max_overrun)
+            return false;
+        sad(sym);
+    }
+    return true;
+}
+
+static PyObject *Decompressor_decompress(PyObject *self, PyObject *args)
+{
+    Decompressor *d = (Decompressor *)self;
+    Py_buffer data;
+
+    if (!PyArg_ParseTuple(args, "s*", &data))
+        return NULL;
+    d->input->feed((const unsigned char *)data.buf, data.len);
+    PyBuffer_Release(&data);
+
+    StringOutputAdapter sad(d->input->available()*4);
+    Decompressor_run(d, Stream_lookahead, sad);
+    return sad.release();
+}
+
+static PyObject *Decompressor_flush(PyObject *self, PyObject *args)
+{
+    Decompressor *d = (Decompressor *)self;
+
+    StringOutputAdapter sad(d->input->available()*4);
+    if (!d->started && d->input->available() == 0)
+        return sad.release();   // Nothing was fed
+    if (!Decompressor_run(d, 0, sad)) {
+        PyErr_SetString(PyExc_ValueError, "truncated or corrupt data");
+        return NULL;
+    }
+    return sad.release();
+}
+
+static PyMethodDef Decompressor_methods[] = {
+    {"decompress", Decompressor_decompress, METH_VARARGS},
+    {"flush", Decompressor_flush, METH_VARARGS},
+    {NULL, NULL},
+};
+
+static PyObject *Decompressor_GetAttr(PyObject *self, char *attrname)
+{
+    Decompressor *d = (Decompressor *)self;
+    if (strcmp(attrname, "eof") == 0)
+        return PyBool_FromLong(d->decoder == NULL);
+    if (strcmp(attrname, "unused_data") == 0) {
+        if (d->decoder != NULL)
+            return PyString_FromStringAndSize("", 0);
+        return PyString_FromStringAndSize((const char *)d->input->data(),
+                                          d->input->available());
+    }
+    return Py_FindMethod(Decompressor_methods, self, attrname);
+}
+
+//====================================================================
+// Block containers, see block_container.h. The base model is an
+// optional frozen Model, the blocks are coded with forks of it
+// without the GIL.
+//====================================================================
+
+// Get the model of a frozen Model or None into *base. Return false
+// with the exception set if obj is neither.
+static bool get_base_model(PyObject *obj, PPMModel **base)
+{
+    if (obj == NULL || obj == Py_None) {
+        *base = NULL;
+    } else if (!Model_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "model must be a Model or None");
+        return false;
+    } else if (!Model_Ptr(obj)->frozen()) {
+        PyErr_SetString(PyExc_RuntimeError, "model is not frozen");
+        return false;
+    } else if (Model_Ptr(obj)->m_base != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot code blocks with a fork");
+        return false;
+    } else {
+        *base = Model_Ptr(obj);
+    }
+    return true;
+}
+
+// Open a container with a matching base model, return false with
+// the exception set on failure
+static bool open_container(PPMBlockReader &reader, const Py_buffer &data,
+                           const PPMModel *base)
+{
+    if (!reader.open((const unsigned char *)data.buf, data.len)) {
+        PyErr_SetString(PyExc_ValueError, "not a block container");
+        return false;
+    }
+    if (!reader.check_base(base)) {
+        PyErr_SetString(PyExc_ValueError, "the base model does not match the container");
+        return false;
+    }
+    return true;
+}
+
+static PyObject *compress_blocks(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+    Py_ssize_t block_size = Container_block_size;
+    int threads = 0;
+    PyObject *model = NULL;
+    PPMModel *base;
+
+    if (!PyArg_ParseTuple(args, "s*|niO", &data, &block_size, &threads, &model))
+        return NULL;
+    if (!get_base_model(model, &base) || block_size <= 0) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "block_size must be positive");
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+
+    PPMBlockWriter writer(base);
+    if (base != NULL)
+        ((Model *)model)->readers++;
+    Py_BEGIN_ALLOW_THREADS
+    writer.compress((const unsigned char *)data.buf, data.len, block_size,
+                    default_threads(threads));
+    Py_END_ALLOW_THREADS
+    if (base != NULL)
+        ((Model *)model)->readers--;
+    PyBuffer_Release(&data);
+
+    PyObject *res = PyString_FromStringAndSize(NULL, writer.size());
+    if (res != NULL)
+        writer.write((unsigned char *)PyString_AS_STRING(res));
+    return res;
+}
+
+static PyObject *decompress_blocks(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+    int threads = 0;
+    PyObject *model = NULL;
+    PPMModel *base;
+    PPMBlockReader reader;
+
+    if (!PyArg_ParseTuple(args, "s*|iO", &data, &threads, &model))
+        return NULL;
+    PyObject *res = NULL;
+    if (get_base_model(model, &base) && open_container(reader, data, base))
+        res = PyString_FromStringAndSize(NULL, reader.raw_size());
+
+    if (res != NULL) {
+        bool ok;
+        if (base != NULL)
+            ((Model *)model)->readers++;
+        Py_BEGIN_ALLOW_THREADS
+        ok = reader.decompress_all(base, (unsigned char *)PyString_AS_STRING(res),
+                                   default_threads(threads));
+        Py_END_ALLOW_THREADS
+        if (base != NULL)
+            ((Model *)model)->readers--;
+        if (!ok) {
+            Py_DECREF(res);
+            res = NULL;
+            PyErr_SetString(PyExc_ValueError, "truncated or corrupt data");
+        }
+    }
+    PyBuffer_Release(&data);
+    return res;
+}
+
+static PyObject *decompress_block(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+    Py_ssize_t index;
+    PyObject *model = NULL;
+    PPMModel *base;
+    PPMBlockReader reader;
+
+    if (!PyArg_ParseTuple(args, "s*n|O", &data, &index, &model))
+        return NULL;
+    PyObject *res = NULL;
+    if (get_base_model(model, &base) && open_container(reader, data, base)) {
+        if (index < 0 || (size_t)index >= reader.block_count())
+            PyErr_SetString(PyExc_IndexError, "block index out of range");
+        else
+            res = PyString_FromStringAndSize(NULL, reader.block(index).raw_size);
+    }
+
+    if (res != NULL &&
+        !reader.decompress(index, base, (unsigned char *)PyString_AS_STRING(res))) {
+        Py_DECREF(res);
+        res = NULL;
+        PyErr_SetString(PyExc_ValueError, "truncated or corrupt data");
+    }
+    PyBuffer_Release(&data);
+    return res;
+}
+
+// The (offset, size) of each block in the uncompressed data
+static PyObject *block_index(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+    PPMBlockReader reader;
+
+    if (!PyArg_ParseTuple(args, "s*", &data))
+        return NULL;
+    PyObject *res = NULL;
+    if (!reader.open((const unsigned char *)data.buf, data.len)) {
+        PyErr_SetString(PyExc_ValueError, "not a block container");
+    } else {
+        res = PyList_New(reader.block_count());
+        for (size_t i = 0; res != NULL && i < reader.block_count(); ++i) {
+            PyObject *item = Py_BuildValue("(KK)",
+                                           (unsigned long long)reader.block(i).raw_offset,
+                                           (unsigned long long)reader.block(i).raw_size);
+            if (item == NULL) {
+                Py_DECREF(res);
+                res = NULL;
+            } else {
+                PyList_SET_ITEM(res, i, item);
+            }
+        }
+    }
+    PyBuffer_Release(&data);
+    return res;
+}
+
+// set_pool_limit(chunks) keeps at most chunks free 2 MB chunks of
+// dropped models mapped for the next ones, the rest are unmapped
+static PyObject *set_pool_limit(PyObject *self, PyObject *args)
+{
+    Py_ssize_t chunks;
+
+    if (!PyArg_ParseTuple(args, "n", &chunks))
+        return NULL;
+    if (chunks < 0) {
+        PyErr_SetString(PyExc_ValueError, "chunks must not be negative");
+        return NULL;
+    }
+    ChunkPool::shared().set_limit(chunks);
+    return Py_BuildValue("");
+}
+
 static PyMethodDef methods[] = {
     {"Model", Model_New, METH_VARARGS},
+    {"compress", compress, METH_VARARGS},
+    {"decompress", decompress, METH_VARARGS},
+    {"compressobj", compressobj, METH_VARARGS},
+    {"decompressobj", decompressobj, METH_VARARGS},
+    {"compress_blocks", compress_blocks, METH_VARARGS},
+    {"decompress_blocks", decompress_blocks, METH_VARARGS},
+    {"decompress_block", decompress_block, METH_VARARGS},
+    {"block_index", block_index, METH_VARARGS},
+    {"set_pool_limit", set_pool_limit, METH_VARARGS},
     {NULL, NULL},
 };
 
@@ -0,0 +1,61 @@
+#ifndef _RANGE_DECODER_H_
+#define _RANGE_DECODER_H_
+
+#include <cstdio>
+#include <stdint.h>
+
+#include "config.h"
+
+template<typename InputAdapter>
+class RangeDecoder
+{
+private:
+    uint32_t m_code;            // Currently-seen code value, relative
+                                // to the low end of the range
+    uint32_t m_range;           // size of current region
+
+    InputAdapter &m_reader;
+
+    unsigned char read() {
+        int byte = m_reader();
+        if (byte == EOF) {      // NOTE: it might be indicating a
+            byte = 0;           // problem when reading too many EOF
+        }
+        return (unsigned char)byte;
+    }
+
+public:
+    RangeDecoder(InputAdapter &reader)
+        :m_code(0), m_range(0xFFFFFFFFU), m_reader(reader) {
+    }
+
+    // Start decoding
+    void start_decoding() {
+        // The first byte written by the encoder is always 0
+        for (int i = 0; i < 5; ++i) {
+            m_code = (m_code<<8) | read();
+        }
+    }
+
+    // Get the cumulative frequence for the next symbol
+    code_value get_cum_freq(code_value total) {
+        code_value cum = m_code / (m_range / (uint32_t)total);
+        return cum < total ? cum : total-1;
+    }
+
+    // Remove the symbol represented by low, high and total
+    // and fetch new bytes if necessary
+    void pop_symbol(code_value low, code_value high, code_value total) {
+        uint32_t r = m_range / (uint32_t)total;
+
+        m_code -= r * (uint32_t)low;
+        m_range = r * (uint32_t)(high-low);
+
+        while (m_range < Range_bottom) {
+            m_code = (m_code<<8) | read();
+            m_range <<= 8;
+        }
+    }
+};
+
+#endif /* _RANGE_DECODER_H_ */
@@ -0,0 +1,74 @@
+#ifndef _RANGE_ENCODER_H_
+#define _RANGE_ENCODER_H_
+
+#include <stdint.h>
+
+#include "config.h"
+
+////////////////////////////////////////////////////////////
+// A range coder renormalizing a byte at a time. The range
+// is kept in 32 bits and the low end in 64 bits, the extra
+// bits of m_low catch the carry which is propagated into the
+// bytes held back in m_cache/m_cache_size.
+////////////////////////////////////////////////////////////
+template<typename OutputAdapter>
+class RangeEncoder
+{
+private:
+    uint64_t m_low;
+    uint32_t m_range;
+
+    // Bytes not written yet since a carry may still change them:
+    // m_cache followed by m_cache_size-1 0xFF bytes
+    unsigned char m_cache;
+    uint64_t m_cache_size;
+
+    OutputAdapter &m_writer;
+
+    // Move the top byte of m_low out
+    void shift_low() {
+        if ((uint32_t)m_low < 0xFF000000U || (m_low >> 32) != 0) {
+            unsigned char carry = (unsigned char)(m_low >> 32);
+            unsigned char byte = m_cache;
+            do {
+                m_writer((unsigned char)(byte+carry));
+                byte = 0xFF;
+            } while (--m_cache_size != 0);
+            m_cache = (unsigned char)(m_low >> 24);
+        }
+        m_cache_size++;
+        m_low = (m_low & 0x00FFFFFF) << 8;
+    }
+
+public:
+    RangeEncoder(OutputAdapter &writer)
+        :m_low(0), m_range(0xFFFFFFFFU), m_cache(0), m_cache_size(1),
+         m_writer(writer) {
+    }
+
+    // Encode a symbol
+    //  - low is the cumulative frequency below the symbol
+    //  - high is the cumulative frequency of the symbol
+    //  - total is the cumulative frequency of all symbols
+    void encode(code_value low, code_value high, code_value total) {
+        uint32_t r = m_range / (uint32_t)total;
+
+        m_low += (uint64_t)r * low;
+        m_range = r * (uint32_t)(high-low);
+
+        while (m_range < Range_bottom) {
+            m_range <<= 8;
+            shift_low();
+        }
+    }
+
+    // Finish encoding, output the remaining bytes
+    void finish_encoding() {
+        for (int i = 0; i < 5; ++i) {
+            shift_low();
+        }
+        m_writer.flush();
+    }
+};
+
+#endif /* _RANGE_ENCODER_H_ */
@@ -1,4 +1,30 @@
-from distutils.core import setup, Extension
+from distutils.core import setup, Command, Extension
+from distutils.ccompiler import new_compiler
+from distutils.sysconfig import customize_compiler
+
+
+# python setup.py build_bench builds the benchmark driver bench.cpp
+# into ./bench
+class build_bench(Command):
+    description = "build the benchmark driver"
+    user_options = [("debug", "g", "compile with debugging information")]
+
+    def initialize_options(self):
+        self.debug = 0
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        compiler = new_compiler(verbose=self.verbose, dry_run=self.dry_run)
+        customize_compiler(compiler)
+        # Link with the C++ driver, not the C one
+        compiler.linker_exe = [compiler.compiler_cxx[0]]
+        objects = compiler.compile(["bench.cpp"], output_dir="build/bench",
+                                   extra_preargs=["-O2"], debug=self.debug)
+        compiler.link_executable(objects, "bench", libraries=["pthread"])
+
 
 setup(name="pyppm", version="0.0.1",
-      ext_modules = [Extension("pyppm", ["pyppm.cpp"])])
+      ext_modules = [Extension("pyppm", ["pyppm.cpp"])],
+      cmdclass = {"build_bench": build_bench})
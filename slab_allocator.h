@@ -1,92 +1,449 @@
 #ifndef _SLAB_ALLOCATOR_H_
 #define _SLAB_ALLOCATOR_H_
 
+#include <cstdio>
+#include <cstring>
 #include <new>
-#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "config.h"
 
 ////////////////////////////////////////////////////////////
 // A slab allocator allocate memory for many objects of the
 // same time.
 //
+// Objects are addressed by 32-bit indices instead of pointers,
+// index 0 is never allocated and serves as the NULL index. An
+// index is turned into a pointer through the block table, the
+// pointer stays valid until the object is released.
+//
 // When memory is needed for an object, it first see whether
 // there are free objects in the freelist. If not, it then
-// look at the current block. It will request a new block if
-// necessary. The new allocated block is not split into the
-// freelist immediately. Only deallocated objects will be put
-// into the freelist.
+// look at the current block. It will request a new block of
+// 2^Block_bits objects if necessary. The new allocated block
+// is not split into the freelist immediately. Only deallocated
+// objects will be put into the freelist.
+//
+// The blocks can be written out as they are and mapped back
+// later, see SlabHeader. Mapped blocks are used in place.
+//
+// Allocators can share a MemoryBudget. Once the blocks of all
+// of them would grow beyond its limit, allocate returns 0
+// instead of requesting a new block, and flags the budget as
+// exhausted so that the owner can release some objects.
+//
+// The blocks come from a SlabArena if the allocator is given
+// one, several allocators can share it. Otherwise they are
+// allocated one by one.
 //
 // When the slab allocator is destroyed, all the blocks are
-// freed. The allocator will NOT call either constructor
-// or destructor.
+// freed except the mapped ones and those of an arena, which
+// frees them itself. The allocator will NOT call either
+// constructor or destructor.
+////////////////////////////////////////////////////////////
+typedef uint32_t slab_index;
+
+// Describes the blocks of an allocator in a snapshot. The
+// blocks are stored back to back starting at offset.
+struct SlabHeader
+{
+    uint32_t object_size;
+    uint32_t block_bits;
+    uint32_t next;
+    uint32_t freelist;
+    uint64_t count;
+    uint64_t offset;
+};
+
+// Write n zero bytes, return false on error
+inline bool write_zeros(FILE *f, size_t n)
+{
+    static const char zeros[256] = { 0 };
+    while (n > 0) {
+        size_t len = n < sizeof(zeros) ? n : sizeof(zeros);
+        if (fwrite(zeros, 1, len, f) != len)
+            return false;
+        n -= len;
+    }
+    return true;
+}
+
 ////////////////////////////////////////////////////////////
-template<typename T, size_t Block_size=4096>
+// The free chunks of Arena_chunk_size bytes of the process,
+// shared by all the arenas. Chunks are mapped aligned to their
+// size and advised to be backed by huge pages, so the objects
+// of a chunk take one TLB entry. A released chunk is kept for
+// the next arena, up to a limit of Arena_pool_chunks of them by
+// default, its pages stay resident.
+////////////////////////////////////////////////////////////
+class ChunkPool
+{
+private:
+    pthread_mutex_t m_lock;
+    std::vector<char *> m_free;
+    size_t m_limit;             // Free chunks kept at most
+
+    // Map a new chunk, throw std::bad_alloc as operator new
+    // would if there is no memory
+    static char *map_chunk() {
+        // Twice the size, so that an aligned chunk fits
+        size_t size = 2*(size_t)Arena_chunk_size;
+        char *p = (char *)mmap(NULL, size, PROT_READ|PROT_WRITE,
+                               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+
+        char *chunk = (char *)(((uintptr_t)p + Arena_chunk_size-1) &
+                               ~(uintptr_t)(Arena_chunk_size-1));
+        if (chunk > p)
+            munmap(p, chunk-p);
+        munmap(chunk+Arena_chunk_size, p+size - (chunk+Arena_chunk_size));
+#ifdef MADV_HUGEPAGE
+        madvise(chunk, Arena_chunk_size, MADV_HUGEPAGE);
+#endif
+        return chunk;
+    }
+
+    ChunkPool()
+        :m_limit(Arena_pool_chunks) {
+        pthread_mutex_init(&m_lock, NULL);
+    }
+
+    ChunkPool(const ChunkPool &);
+    ChunkPool &operator = (const ChunkPool &);
+
+public:
+    // The pool of the process
+    static ChunkPool &shared() {
+        static ChunkPool pool;
+        return pool;
+    }
+
+    char *get() {
+        char *chunk = NULL;
+        pthread_mutex_lock(&m_lock);
+        if (!m_free.empty()) {
+            chunk = m_free.back();
+            m_free.pop_back();
+        }
+        pthread_mutex_unlock(&m_lock);
+        return chunk != NULL ? chunk : map_chunk();
+    }
+
+    void put(char *chunk) {
+        pthread_mutex_lock(&m_lock);
+        bool keep = m_free.size() < m_limit;
+        if (keep)
+            m_free.push_back(chunk);
+        pthread_mutex_unlock(&m_lock);
+        if (!keep)
+            munmap(chunk, Arena_chunk_size);
+    }
+
+    // Keep at most limit free chunks from now on, unmapping those
+    // beyond it
+    void set_limit(size_t limit) {
+        std::vector<char *> trimmed;
+        pthread_mutex_lock(&m_lock);
+        m_limit = limit;
+        while (m_free.size() > m_limit) {
+            trimmed.push_back(m_free.back());
+            m_free.pop_back();
+        }
+        pthread_mutex_unlock(&m_lock);
+        for (size_t i = 0; i < trimmed.size(); ++i)
+            munmap(trimmed[i], Arena_chunk_size);
+    }
+
+    // Number of free chunks
+    size_t size() {
+        pthread_mutex_lock(&m_lock);
+        size_t n = m_free.size();
+        pthread_mutex_unlock(&m_lock);
+        return n;
+    }
+};
+
+////////////////////////////////////////////////////////////
+// Blocks of any size up to Arena_chunk_size. The first ones, up
+// to Arena_heap_size bytes, are allocated from the heap one by
+// one, so that a small trie takes no more than its blocks. The
+// next ones are carved one after the other from chunks of the
+// shared ChunkPool. Blocks are not freed one by one, reset
+// gives them all back at once.
+////////////////////////////////////////////////////////////
+class SlabArena
+{
+private:
+    enum { Alignment = 64 };    // A cache line
+
+    std::vector<void *> m_heap; // The blocks from the heap
+    size_t m_heap_size;         // Their bytes
+    std::vector<char *> m_chunks;
+    size_t m_used;              // Bytes taken from the last chunk
+
+    SlabArena(const SlabArena &);
+    SlabArena &operator = (const SlabArena &);
+
+public:
+    SlabArena()
+        :m_heap_size(0), m_used(Arena_chunk_size) {
+    }
+    ~SlabArena() {
+        reset();
+    }
+
+    void *allocate(size_t size) {
+        size = (size + Alignment-1) & ~(size_t)(Alignment-1);
+        if (m_chunks.empty() && m_heap_size+size <= Arena_heap_size) {
+            m_heap.push_back(operator new(size));
+            m_heap_size += size;
+            return m_heap.back();
+        }
+        if (m_used+size > Arena_chunk_size) {
+            m_chunks.push_back(ChunkPool::shared().get());
+            m_used = 0;
+        }
+        void *p = m_chunks.back() + m_used;
+        m_used += size;
+        return p;
+    }
+
+    // Free all the blocks
+    void reset() {
+        for (size_t i = 0; i < m_heap.size(); ++i)
+            operator delete(m_heap[i]);
+        m_heap.clear();
+        m_heap_size = 0;
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+            ChunkPool::shared().put(m_chunks[i]);
+        m_chunks.clear();
+        m_used = Arena_chunk_size;
+    }
+
+    // Bytes taken by the heap blocks and the chunks
+    size_t memory() const {
+        return m_heap_size + m_chunks.size()*(size_t)Arena_chunk_size;
+    }
+};
+
+// Bytes taken by the blocks of the allocators sharing it
+struct MemoryBudget
+{
+    size_t limit;               // 0 for no limit
+    size_t used;
+    bool exhausted;             // Some allocation was refused
+
+    MemoryBudget()
+        :limit(0), used(0), exhausted(false) {
+    }
+};
+
+template<typename T, int Block_bits=10>
 class SlabAllocator
 {
 private:
-    struct Node
-    {
-        Node *next;
+    enum {
+        Block_objects = 1<<Block_bits,
+        Block_mask = Block_objects-1
     };
 
-    Node  *m_blocks;            // Allocated blocks chained together
+    std::vector<T *> m_blocks;  // Allocated blocks, indexed by the
+                                // high bits of an object index
 
-    char  *m_block;             // Current block used for allocating
-    size_t m_block_remain;      // How many bytes remained for current block
+    size_t m_mapped;            // The first m_mapped blocks are not ours
+    SlabArena *m_arena;         // NULL to allocate blocks one by one
+    MemoryBudget *m_budget;     // NULL for no budget
 
-    Node  *m_freelist;          // Released objects are chained here
+    slab_index m_next;          // Next never-allocated index
+    slab_index m_freelist;      // Released objects are chained here
+    size_t m_count;             // Number of objects in use
 
-    void get_new_block() {
-        Node *block = (Node *)operator new(Block_size);
+    T *new_block() {
+        size_t size = sizeof(T)*Block_objects;
+        if (m_arena != NULL)
+            return (T *)m_arena->allocate(size);
+        return (T *)operator new(size);
+    }
 
-        // Link blocks for later release
-        block->next = m_blocks;
-        m_blocks = block;
+    void free_blocks() {
+        if (m_arena == NULL) {
+            for (size_t i = m_mapped; i < m_blocks.size(); ++i)
+                operator delete(m_blocks[i]);
+        }
+        if (m_budget != NULL)
+            m_budget->used -= memory();
+        m_blocks.clear();
+        m_mapped = 0;
+    }
 
-        char *mem = (char *)block;
+    // Return false if the budget does not allow a new block
+    bool get_new_block() {
+        size_t size = sizeof(T)*Block_objects;
+        if (m_budget != NULL) {
+            if (m_budget->limit != 0 && m_budget->used+size > m_budget->limit) {
+                m_budget->exhausted = true;
+                return false;
+            }
+            m_budget->used += size;
+        }
+        m_blocks.push_back(new_block());
+        return true;
+    }
 
-        // Skip the header used to link the blocks together
-        size_t skip = std::max(sizeof(Node), sizeof(T));
-        mem += skip;
+    SlabAllocator(const SlabAllocator &);
+    SlabAllocator &operator = (const SlabAllocator &);
 
-        m_block = mem;
-        m_block_remain = Block_size-skip;
-    }
-    
 public:
     SlabAllocator()
-        :m_blocks(NULL), m_block(NULL), m_block_remain(0), m_freelist(NULL) {
+        :m_mapped(0), m_arena(NULL), m_budget(NULL), m_next(1), m_freelist(0),
+         m_count(0) {
     }
     ~SlabAllocator() {
-        Node *next;
-        while (m_blocks != NULL) {
-            next = m_blocks->next;
-            delete m_blocks;
-            m_blocks = next;
-        }
+        free_blocks();
+    }
+
+    T *get(slab_index i) const {
+        return m_blocks[i >> Block_bits] + (i & Block_mask);
+    }
+
+    // Take the blocks from arena from now on, before any is
+    // allocated. The arena must outlive the allocator.
+    void set_arena(SlabArena *arena) {
+        m_arena = arena;
     }
 
-    // Allocate 
-    T *allocate() {
-        if (m_freelist == NULL) {
-            if (m_block_remain < sizeof(T)) {
-                get_new_block();
+    // Count the blocks in budget from now on
+    void set_budget(MemoryBudget *budget) {
+        m_budget = budget;
+        m_budget->used += memory();
+    }
+
+    // Whether allocate would fail, without flagging the budget
+    bool full() const {
+        return m_freelist == 0 && (m_next >> Block_bits) == m_blocks.size() &&
+            m_budget != NULL && m_budget->limit != 0 &&
+            m_budget->used+sizeof(T)*Block_objects > m_budget->limit;
+    }
+
+    // Allocate, return 0 if the budget is exhausted
+    slab_index allocate() {
+        slab_index res;
+        if (m_freelist == 0) {
+            if ((m_next >> Block_bits) == m_blocks.size() &&
+                !get_new_block()) {
+                return 0;
             }
-            T *res = (T *)m_block;
-            m_block += sizeof(T);
-            m_block_remain -= sizeof(T);
-            return res;
+            res = m_next++;
         } else {
-            Node *res = m_freelist;
-            m_freelist = m_freelist->next;
-            return (T *)res;
+            res = m_freelist;
+            m_freelist = *(slab_index *)get(res);
         }
+        m_count++;
+        return res;
     }
 
     // Release
-    void release(T *t) {
-        Node *obj = (Node *)t;
-        obj->next = m_freelist;
-        m_freelist = obj;
+    void release(slab_index i) {
+        *(slab_index *)get(i) = m_freelist;
+        m_freelist = i;
+        m_count--;
+    }
+
+    // Number of objects in use
+    size_t count() const {
+        return m_count;
+    }
+
+    // Number of blocks, mapped ones included
+    size_t blocks() const {
+        return m_blocks.size();
+    }
+
+    // Bytes taken by the blocks
+    size_t memory() const {
+        return m_blocks.size()*sizeof(T)*Block_objects;
+    }
+
+    // Drop all objects and take a copy of the objects of other,
+    // at the same indices
+    void copy(const SlabAllocator &other) {
+        free_blocks();
+        for (size_t i = 0; i < other.m_blocks.size(); ++i) {
+            T *block = new_block();
+            memcpy(block, other.m_blocks[i], sizeof(T)*Block_objects);
+            m_blocks.push_back(block);
+        }
+        if (m_budget != NULL)
+            m_budget->used += memory();
+        m_next = other.m_next;
+        m_freelist = other.m_freelist;
+        m_count = other.m_count;
+    }
+
+    // Drop all objects and free the blocks, the blocks of an arena
+    // are left to it
+    void reset() {
+        free_blocks();
+        m_next = 1;
+        m_freelist = 0;
+        m_count = 0;
+    }
+
+    // Describe the blocks as written by dump at offset
+    SlabHeader header(uint64_t offset) const {
+        SlabHeader h;
+        h.object_size = sizeof(T);
+        h.block_bits = Block_bits;
+        h.next = m_next;
+        h.freelist = m_freelist;
+        h.count = m_count;
+        h.offset = offset;
+        return h;
+    }
+
+    // Write all the blocks, the never-allocated tail of the last
+    // one as zeros. Return false on error.
+    bool dump(FILE *f) const {
+        for (size_t i = 0; i < m_blocks.size(); ++i) {
+            size_t n = m_next - (i << Block_bits);
+            if (n > Block_objects)
+                n = Block_objects;
+            if (fwrite(m_blocks[i], sizeof(T), n, f) != n ||
+                !write_zeros(f, sizeof(T)*(Block_objects-n)))
+                return false;
+        }
+        return true;
+    }
+
+    // Drop all objects and use the blocks described by h in the
+    // snapshot at base instead. The snapshot must outlive the
+    // allocator. Return false if h does not fit in size bytes or
+    // does not match this allocator.
+    bool map(const SlabHeader &h, char *base, size_t size) {
+        // Index 0 is never allocated, an allocator still at
+        // next == 1 has no block
+        size_t blocks = h.next > 1 ? ((size_t)(h.next-1) >> Block_bits) + 1 : 0;
+        size_t block_bytes = sizeof(T)*Block_objects;
+        if (h.object_size != sizeof(T) || h.block_bits != Block_bits ||
+            h.next == 0 || h.offset > size ||
+            (size-h.offset)/block_bytes < blocks)
+            return false;
+
+        free_blocks();
+        for (size_t i = 0; i < blocks; ++i) {
+            m_blocks.push_back((T *)(base+h.offset+i*block_bytes));
+        }
+        m_mapped = blocks;
+        if (m_budget != NULL)
+            m_budget->used += memory();
+        m_next = h.next;
+        m_freelist = h.freelist;
+        m_count = h.count;
+        return true;
     }
 };
 
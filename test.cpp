@@ -1,28 +1,125 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 #include "ppm_model.h"
 #include "buffer.h"
 #include "io_adapter.h"
 
 using namespace std;
 
+// Fill count with random counts, about one in density of them not
+// zero, adding up to less than an unsigned short
+static void random_counts(unsigned short *count, int density)
+{
+    for (int s = 0; s < No_of_chars; ++s)
+        count[s] = rand() % density == 0 ? rand() % 200 + 1 : 0;
+}
+
+// Compare the SIMD kernels the CPU has with the scalar loops on
+// random leaf tables, for every length within a block and every
+// cumulative frequency, return the number of mismatches
+static int check_kernels()
+{
+    int errors = 0;
+#ifdef PPM_SIMD_X86
+    __builtin_cpu_init();
+    bool sse2 = __builtin_cpu_supports("sse2");
+    bool avx2 = __builtin_cpu_supports("avx2");
+    unsigned short count[No_of_chars];
+    for (int t = 0; t < 200; ++t) {
+        random_counts(count, 1 + t%8);
+        for (int first = 0; first < No_of_chars; first += Cum_freq_block_size) {
+            const unsigned short *block = count+first;
+            for (int sym = 0; sym <= Cum_freq_block_size; ++sym) {
+                unsigned sum = cum_freq_below_scalar(block, sym);
+                errors += sse2 && cum_freq_below_sse2(block, sym) != sum;
+                errors += avx2 && cum_freq_below_avx2(block, sym) != sum;
+            }
+        }
+        for (int n = Cum_freq_block_size; n <= No_of_chars; n += No_of_chars-Cum_freq_block_size) {
+            unsigned total = cum_freq_below_scalar(count, n);
+            for (unsigned cum = 0; cum <= total; ++cum) {
+                unsigned below, simd_below;
+                int s = cum_freq_find_scalar(count, n, cum, below);
+                if (sse2)
+                    errors += cum_freq_find_sse2(count, n, cum, simd_below) != s ||
+                        simd_below != below;
+                if (avx2)
+                    errors += cum_freq_find_avx2(count, n, cum, simd_below) != s ||
+                        simd_below != below;
+            }
+        }
+    }
+    printf("SIMD kernels (%s): %d mismatches\n",
+           avx2 ? "sse2, avx2" : sse2 ? "sse2" : "none", errors);
+#endif
+    return errors;
+}
+
+// Compare the Fenwick tree of random leaf tables with the scalar
+// loops over the whole table, for every symbol, the total and
+// every cumulative frequency, before and after counts are added.
+// Return the number of mismatches.
+static int check_fenwick()
+{
+    int errors = 0;
+    unsigned short count[No_of_chars];
+    unsigned short tree[Cum_freq_blocks];
+    for (int t = 0; t < 200; ++t) {
+        random_counts(count, 1 + t%8);
+        cum_freq_build(count, tree);
+        for (int round = 0; round < 2; ++round) {
+            unsigned total = cum_freq_below_scalar(count, No_of_chars);
+            errors += cum_freq_total(tree) != total;
+            for (int sym = 0; sym < No_of_chars; ++sym)
+                errors += cum_freq_below(count, tree, sym) !=
+                    cum_freq_below_scalar(count, sym);
+            for (unsigned cum = 0; cum <= total; ++cum) {
+                unsigned below, tree_below;
+                int s = cum_freq_find_scalar(count, No_of_chars, cum, below);
+                errors += cum_freq_find(count, tree, cum, tree_below) != s ||
+                    tree_below != below;
+            }
+
+            // Raise some counts as update_model does
+            for (int i = 0; i < 50; ++i) {
+                int sym = rand() % No_of_chars;
+                count[sym] += 3;
+                cum_freq_add(tree, sym, 3);
+            }
+        }
+    }
+    printf("Fenwick trees: %d mismatches\n", errors);
+    return errors;
+}
+
 int main(int argc, char *argv[])
 {
     FILE *fout = fopen("encoded.txt", "wb");
-    FILE *forig = fopen("input.txt", "rb");
+    MappedFile forig;
+    forig.open("input.txt");
 
-    FileOutputAdapter foad(fout);
+    {
+        // The adapter and the encoder go before the file
+        FileOutputAdapter foad(fout);
 
-    PPMEncoder<FileOutputAdapter, DefaultContextUpdater> *penc =
-        new PPMEncoder<FileOutputAdapter, DefaultContextUpdater>(foad);
+        PPMEncoder<FileOutputAdapter, DefaultContextUpdater> *penc =
+            new PPMEncoder<FileOutputAdapter, DefaultContextUpdater>(foad);
 
-    printf("Encoding...\n");
-    penc->start_encoding();
-    for (int ch = fgetc(forig); ch != EOF; ch = fgetc(forig))
-        penc->encode(ch);
-    penc->finish_encoding();
+        printf("Encoding...\n");
+        penc->start_encoding();
+        penc->encode(forig.data(), forig.size());
+        penc->finish_encoding();
 
+        Trie &contexts = penc->model()->m_contexts;
+        printf("%lu contexts, %lu bytes, %.1f bytes per context\n",
+               (unsigned long)contexts.no_of_contexts(),
+               (unsigned long)contexts.memory(),
+               (double)contexts.memory()/contexts.no_of_contexts());
+        delete penc;
+    }
     fclose(fout);
-    fclose(forig);
 
     printf("------------------------------------\n");
     
@@ -42,8 +139,45 @@ int main(int argc, char *argv[])
         fputc(sym, fnew);
     }
     pdec->finish_decoding();
+    delete pdec;
     fclose(fin);
     fclose(fnew);
-    
+
+    printf("------------------------------------\n");
+
+    // A model this small leaves some allocators without a block
+    const char *tiny = "hello hello hello world";
+    PPMModel *model = new PPMModel();
+    ppm_train(model, (const unsigned char *)tiny, strlen(tiny));
+    if (!PPMModel::dump(model, "tiny.snap")) {
+        perror("dump tiny.snap");
+        return 1;
+    }
+    PPMModel *loaded = PPMModel::load("tiny.snap");
+    if (loaded == NULL) {
+        perror("load tiny.snap");
+        return 1;
+    }
+
+    std::vector<float> costs(strlen(tiny)), loaded_costs(strlen(tiny));
+    double bits = ppm_score_positions(model, (const unsigned char *)tiny,
+                                      strlen(tiny), &costs[0], NULL, NULL);
+    double loaded_bits = ppm_score_positions(loaded, (const unsigned char *)tiny,
+                                             strlen(tiny), &loaded_costs[0], NULL, NULL);
+    printf("Tiny model: %lu contexts, %.1f bits dumped, %.1f bits loaded\n",
+           (unsigned long)loaded->m_contexts.no_of_contexts(), bits, loaded_bits);
+    if (loaded->m_contexts.no_of_contexts() != model->m_contexts.no_of_contexts() ||
+        loaded_costs != costs) {
+        printf("Loaded tiny model differs\n");
+        return 1;
+    }
+    model->decref();
+    loaded->decref();
+
+    printf("------------------------------------\n");
+
+    if (check_kernels() != 0 || check_fenwick() != 0)
+        return 1;
+
     return 0;
 }
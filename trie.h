@@ -2,390 +2,1730 @@
 #define _TRIE_H_
 
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 
 #include "config.h"
 #include "buffer.h"
-#include "arithmetic_encoder.h"
-#include "arithmetic_decoder.h"
 #include "slab_allocator.h"
+#include "cum_freq.h"
+#include "context_index.h"
+#include "ppm_stats.h"
 
-class TrieNode
+// A symbol seen in some context
+class TrieLeaf
 {
 private:
-    symbol_t m_value;           // The value of this node
+    symbol_t m_value;           // The symbol predicted by this leaf
     unsigned short m_count;     // The scaled count
-    unsigned short m_escape;    // The scaled number of escapes
-    TrieNode *m_child;          // The first child
-    TrieNode *m_sibling;        // The next sibling
+    slab_index m_sibling;       // The next symbol in the same context
 
     friend class Trie;
 
 public:
-    TrieNode(symbol_t value, TrieNode *child=NULL)
-        :m_value(value), m_child(child) {
-        m_count = 1;
-        m_escape = 1;
-        m_sibling = NULL;
-
-        if (m_child != NULL)
-            m_count++;
+    TrieLeaf(symbol_t value, slab_index sibling=0)
+        :m_value(value), m_count(1), m_sibling(sibling) {
     }
+};
 
-    static void dump(TrieNode *node, FILE *f) {
-        char flag = 0;
-        if (node == NULL) {
-            fwrite(&flag, sizeof(flag), 1, f);
-        } else {
-            flag = 1;
-            fwrite(&flag, sizeof(flag), 1, f);
+// Children of a high-fanout context, indexed by symbol
+struct TrieChildTable
+{
+    slab_index m_child[No_of_chars];
+};
 
-            write_int(node->m_value, f);
-            write_int(node->m_count, f);
-            write_int(node->m_escape, f);
-            dump(node->m_child, f);
-            dump(node->m_sibling, f);
-        }
-    }
+// Leaves of a high-fanout context, the count of each symbol
+// indexed by symbol, 0 for symbols not seen in the context, and
+// the Fenwick tree of cum_freq.h over them
+struct TrieLeafTable
+{
+    unsigned short m_count[No_of_chars];
+    unsigned short m_tree[Cum_freq_blocks];
+};
 
-    static TrieNode *load(FILE *f) {
-        char flag;
-        fread(&flag, sizeof(flag), 1, f);
-        if (flag == 0) {
-            return NULL;
-        } else {
-            TrieNode *node = (TrieNode *)operator new(sizeof(TrieNode));
-            node->m_value = (symbol_t)read_int(f);
-            node->m_count = (unsigned short)read_int(f);
-            node->m_escape = (unsigned short)read_int(f);
-            node->m_child = load(f);
-            node->m_sibling = load(f);
+// Header of a trie snapshot, see Trie::dump
+struct TrieSnapshot
+{
+    char magic[4];              // Snapshot_magic
+    uint32_t version;           // Snapshot_version
+    uint32_t byte_order;        // Snapshot_byte_order as the writer sees it
+    uint32_t max_frequency;
+    uint32_t order;             // Order of the model, see Trie::order
+    uint32_t exclusion;         // 1 if the trie excludes symbols
+    uint32_t root;
+    SlabHeader slabs[4];        // Nodes, leaves, leaf tables, child tables
+};
 
-            return node;
-        }
+// The shape of a trie, see Trie::census
+struct TrieCensus
+{
+    size_t m_contexts[Max_order+1];  // Contexts of each order
+    size_t m_leaves;            // Symbols in leaf lists
+    size_t m_leaf_tables;
+    size_t m_child_tables;
+    size_t m_blocks[4];         // Slab blocks of nodes, leaves, leaf
+                                // tables and child tables
+};
+
+class TrieNode;
+class Trie;
+
+// Symbols ruled out while coding one symbol, those of the
+// contexts it escaped from, see Trie::set_exclusion. The mask is
+// ANDed with the counts of a leaf table to leave them out.
+struct TrieExclusion
+{
+    unsigned short m_keep[No_of_chars];    // 0 for the excluded symbols,
+                                           // 0xFFFF for the others
+    bool m_any;                 // Whether any symbol is excluded
+
+    TrieExclusion() {
+        clear();
     }
 
-private:
-    static void write_int(unsigned int n, FILE *f) {
-        unsigned char ch;
-        for (int i = 0; i < (int)sizeof(unsigned int); ++i) {
-            ch = n & 0xFF;
-            n >>= 8;
-            fwrite(&ch, 1, 1, f);
-        }
+    void clear() {
+        memset(m_keep, 0xFF, sizeof(m_keep));
+        m_any = false;
     }
+    bool test(int s) const {
+        return m_keep[s] == 0;
+    }
+    void set(int s) {
+        m_keep[s] = 0;
+        m_any = true;
+    }
+};
 
-    static unsigned int read_int(FILE *f) {
-        unsigned char buf[sizeof(int)];
-        fread(buf, 1, sizeof(buf), f);
-        unsigned int n = 0;
-        for (int i = (int)sizeof(int)-1; i >= 0; --i) {
-            n <<= 8;
-            n |= buf[i];
-        }
-        return n;
+// The contexts of a buffer as found by Trie::find_context, for
+// coding with a trie that is shared and not modified
+struct TrieVine
+{
+    TrieNode *m_ctx[Max_order+1];    // m_ctx[k] is the order-k context
+    const Trie *m_owner[Max_order+1];// The trie holding m_ctx[k]
+    TrieExclusion m_excluded;   // Symbols excluded by the escapes so far
+};
+
+// A context of the PPM model. Links are indices into the slab
+// allocators of the Trie, 0 for none.
+class TrieNode
+{
+private:
+    enum {
+        Dense_leaves   = 1,     // m_leaves is a TrieLeafTable
+        Dense_children = 2,     // m_child is a TrieChildTable
+        Shadow         = 4      // A copy of a context of the base trie
+    };
+
+    symbol_t m_value;           // The oldest symbol of this context
+    unsigned char m_flags;      // Which of the links below are tables
+    unsigned short m_count;     // The scaled count of all leaves and escapes
+    unsigned short m_escape;    // The scaled number of escapes
+    slab_index m_leaves;        // Symbols seen in this context
+    slab_index m_child;         // The first context one order longer
+    slab_index m_sibling;       // The next sibling
+
+    friend class Trie;
+
+public:
+    TrieNode(symbol_t value)
+        :m_value(value), m_flags(0), m_count(0), m_escape(0),
+         m_leaves(0), m_child(0), m_sibling(0) {
     }
 };
 
 
 //====================================================================
-// The Trie used in PPM is a special Trie -- all leaves are on the
-// same level.
+// The Trie holds all the contexts of the PPM model in one tree.
+//
+// * The root is the empty (order-0) context. A node at depth k is an
+//   order-k context, its children are the order-(k+1) contexts that
+//   extend it by one older symbol. So walking down from the root
+//   along buf[len-1], buf[len-2], ... visits every order once.
 //
-// * Nodes with NULL child link are leaves. Leaf node maintain the
-//   following properties:
+// * Each context keeps the symbols seen after it in a list of leaves:
 //    - value: the symbol predicted by this leaf
 //    - count: the number of occurance of this symbol in this context
-//
-// * The direct parent of a leaf node is a deterministic node, which
-//   maintain the following properties:
-//    - count: the sum of count property of all children
+//   and the context itself maintains
+//    - count: the sum of count property of all leaves plus escapes
 //    - escape: the number of escape happened in this context
 //
-// * The root node is only there for convenience of manipulation.
+// * The parent of an order-k context is its order-(k-1) suffix, the
+//   vine. find_context records the path it walked down, so coding a
+//   symbol from the longest context down to order 0 and updating all
+//   of them afterwards follows the recorded vine instead of a new
+//   walk from the root per order. A symbol that escapes from order 0
+//   too is coded uniformly among the symbols order 0 has not seen,
+//   see encode_uniform.
+//
+// * Contexts with many children or leaves switch from the linked
+//   lists to tables indexed by symbol. The leaf table goes back to a
+//   list when rescaling leaves only a few symbols in the context.
+//   In a leaf table the cumulative frequencies are in symbol order,
+//   and a Fenwick tree over blocks of the counts finds them in a
+//   few steps, see cum_freq.h. The tree is built on promotion and
+//   after rescaling, and kept up to date by every count change.
+//
+// * Nodes link to each other by 32-bit indices into the slab
+//   allocators, a context takes 20 bytes and a leaf 8 bytes.
 //
-//  * Other nodes are normal nodes used to form the tree skeleton.
+// * The contexts of up to Index_max_order symbols can also be found
+//   by their symbols in a ContextIndex, one probe per order instead
+//   of one node after the other, see set_context_index.
+//
+// * A trie can overlay a base trie that is not modified, see
+//   overlay. Its own nodes form a subtree of the union of both:
+//   a context of the base is copied into the overlay, as a Shadow
+//   node, the first time it is updated, along with every shorter
+//   context on its vine, which are updated with it. Contexts are
+//   found by walking down both tries at once, the overlay's copy
+//   of a context hides the base's.
 //====================================================================
 
 class Trie
 {
 private:
 
+    // Shared by the allocators below, declared first so that they
+    // outlive them
+    MemoryBudget m_budget;
+    SlabArena m_arena;
+
     SlabAllocator<TrieNode> m_allocator;
-    TrieNode *m_root;
+    SlabAllocator<TrieLeaf> m_leaf_allocator;
+    SlabAllocator<TrieLeafTable, 6> m_leaf_table_allocator;
+    SlabAllocator<TrieChildTable, 5> m_child_table_allocator;
+    slab_index m_root;
 
-    // Cache for updating model, set m_cache_parent to NULL to invalidate
-    // the cache
-    TrieNode *m_cache_parent;     // The cached parent node
-    TrieNode *m_cache_child;      // The cached child node
-    int m_cache_buf_idx;        // The cached index in the buffer
-    
-    TrieNode *create_node(const Buffer &buf, int offset, symbol_t sym) {
-        // Leaf node
-        TrieNode *node = new(m_allocator.allocate()) TrieNode(sym);
+    // Contexts are rescaled when their total count reaches this,
+    // it must not exceed what the entropy coder can handle
+    int m_max_frequency;
 
-        for (int i = buf.length() - 1; i >= offset; --i) {
-            node = new(m_allocator.allocate()) TrieNode(buf[i], node);
-        }
-        return node;
+    // Length of the longest contexts, that of the buffers the
+    // contexts are found and updated for
+    int m_order;
+
+    // What to do when the memory budget is exhausted
+    int m_reclaim_policy;
+    size_t m_reclaims;          // Times the budget ran out
+    size_t m_reclaimed;         // Contexts released since
+    size_t m_rescales;          // Times a context was rescaled
+
+    // The trie this one overlays, NULL for none, and the number
+    // of Shadow nodes copied from it
+    const Trie *m_base;
+    size_t m_shadows;
+
+    // The contexts of the buffer found by find_context, m_vine[k]
+    // is the order-k context, held by m_owner[k], this trie or
+    // the base
+    TrieNode *m_vine[Max_order+1];
+    const Trie *m_owner[Max_order+1];
+
+    // Cache for updating model, set m_cache_valid to false to
+    // invalidate the cache
+    bool m_cache_valid;
+    int m_cache_order;          // Order of the longest existing context
+    int m_cache_coded;          // The last order the symbol is coded
+                                // in, -1 for none tried yet
+    TrieLeaf *m_cache_leaf;     // The leaf found in that context
+
+    // Whether the symbols of the contexts escaped from are excluded
+    // from the shorter ones, and those excluded so far for the
+    // symbol being coded
+    bool m_exclusion;
+    TrieExclusion m_excluded;
+
+    // Whether the contexts are found through m_index, see
+    // set_context_index. An overlay has no index.
+    bool m_indexed;
+    ContextIndex m_index;
+
+    static uint64_t align(uint64_t offset) {
+        return (offset + Snapshot_alignment-1) & ~(uint64_t)(Snapshot_alignment-1);
     }
-    
-public:
-    Trie() :m_root(NULL), m_cache_parent(NULL) { }
 
-    void dump(FILE *f) {
-        TrieNode::dump(m_root, f);
+    TrieNode *node(slab_index i) const {
+        return m_allocator.get(i);
+    }
+    TrieLeaf *leaf(slab_index i) const {
+        return m_leaf_allocator.get(i);
     }
-    void load(FILE *f) {
-        m_root = TrieNode::load(f);
+    TrieLeafTable *leaf_table(const TrieNode *ctx) const {
+        return m_leaf_table_allocator.get(ctx->m_leaves);
+    }
+    TrieChildTable *child_table(const TrieNode *parent) const {
+        return m_child_table_allocator.get(parent->m_child);
     }
 
-    
-    ////////////////////////////////////////////////////////////
-    /// Encode symbol.
-    ///
-    /// Return true if predict successfully, false if escaped.
-    ////////////////////////////////////////////////////////////
-    template<typename Adapter>
-    bool encode(ArithmeticEncoder<Adapter> *encoder, const Buffer &buf,
-                int offset, symbol_t sym) {
-        if (m_root == NULL) {
+    // Only for contexts without a leaf table
+    TrieLeaf *find_leaf(TrieNode *ctx, symbol_t sym) {
+        for (slab_index i = ctx->m_leaves; i != 0; ) {
+            TrieLeaf *l = leaf(i);
+            if (l->m_value == sym)
+                return l;
+            i = l->m_sibling;
+        }
+        return NULL;
+    }
 
-            // Context not initialized yet, simply escape
-            return false;
+    TrieNode *find_child(const TrieNode *parent, symbol_t value) const {
+        slab_index i = child_index(parent, value);
+        return i == 0 ? NULL : node(i);
+    }
+
+    // As find_child, 0 for none
+    slab_index child_index(const TrieNode *parent, symbol_t value) const {
+        if (parent->m_flags & TrieNode::Dense_children)
+            return child_table(parent)->m_child[value];
+
+        for (slab_index i = parent->m_child; i != 0; ) {
+            const TrieNode *n = node(i);
+            if (n->m_value == value)
+                return i;
+            i = n->m_sibling;
+        }
+        return 0;
+    }
+
+    void add_child(TrieNode *parent, slab_index i) {
+        TrieNode *child = node(i);
+        if (parent->m_flags & TrieNode::Dense_children) {
+            child_table(parent)->m_child[child->m_value] = i;
         } else {
-            TrieNode *parent = m_root;
-            TrieNode *node = NULL;
+            child->m_sibling = parent->m_child;
+            parent->m_child = i;
 
-            for (int i = offset; i < buf.length(); ++i) {
-                node = parent->m_child;
+            int n = 0;
+            for (; i != 0; i = node(i)->m_sibling)
+                ++n;
+            if (n > Dense_children_threshold)
+                promote_children(parent);
+        }
+    }
 
-                // Search for proper node
-                while (node != NULL &&
-                       node->m_value != buf[i])
-                    node = node->m_sibling;
+    // The promotions keep the list if the budget does not allow a
+    // table, that is no reason to reclaim memory
+    void promote_children(TrieNode *parent) {
+        if (m_child_table_allocator.full())
+            return;
+        slab_index t = m_child_table_allocator.allocate();
+        TrieChildTable *table = m_child_table_allocator.get(t);
+        std::memset(table, 0, sizeof(TrieChildTable));
 
-                if (node == NULL) {
-                    // Set up cache for updating model
-                    m_cache_parent = parent;
-                    m_cache_child = node;
-                    m_cache_buf_idx = i;
+        for (slab_index i = parent->m_child; i != 0; ) {
+            TrieNode *child = node(i);
+            table->m_child[child->m_value] = i;
+            i = child->m_sibling;
+            child->m_sibling = 0;
+        }
 
-                    // Context not match, simply skip
-                    return false;             // Escape
-                } else {
-                    parent = node;
+        parent->m_child = t;
+        parent->m_flags |= TrieNode::Dense_children;
+    }
+
+    void promote_leaves(TrieNode *ctx) {
+        if (m_leaf_table_allocator.full())
+            return;
+        slab_index t = m_leaf_table_allocator.allocate();
+        TrieLeafTable *table = m_leaf_table_allocator.get(t);
+        std::memset(table, 0, sizeof(TrieLeafTable));
+
+        for (slab_index i = ctx->m_leaves; i != 0; ) {
+            TrieLeaf *l = leaf(i);
+            slab_index next = l->m_sibling;
+            table->m_count[l->m_value] = l->m_count;
+            m_leaf_allocator.release(i);
+            i = next;
+        }
+        cum_freq_build(table->m_count, table->m_tree);
+
+        ctx->m_leaves = t;
+        ctx->m_flags |= TrieNode::Dense_leaves;
+    }
+
+    // The leaves are listed in symbol order. Keep the table if
+    // the budget does not allow the leaves.
+    void demote_leaves(TrieNode *ctx) {
+        TrieLeafTable *table = leaf_table(ctx);
+        slab_index leaves = 0;
+
+        for (int s = No_of_chars-1; s >= 0; --s) {
+            if (table->m_count[s] != 0) {
+                slab_index i = m_leaf_allocator.allocate();
+                if (i == 0) {
+                    release_leaves(leaves);
+                    return;
                 }
+                TrieLeaf *l = new(leaf(i)) TrieLeaf(s, leaves);
+                l->m_count = table->m_count[s];
+                leaves = i;
             }
-            
-            code_value cum = 0;
-            bool res;
-            node = parent->m_child;
-            // Search for proper leaf
-            while (node != NULL &&
-                   node->m_value != sym) {
-                cum += node->m_count;
-                node = node->m_sibling;
+        }
+        m_leaf_table_allocator.release(ctx->m_leaves);
+
+        ctx->m_leaves = leaves;
+        ctx->m_flags &= ~TrieNode::Dense_leaves;
+    }
+
+    // Add a new context as child of parent, with sym as the only
+    // symbol seen so far. Return NULL if the budget does not allow
+    // a new context.
+    TrieNode *create_node(TrieNode *parent, symbol_t value, symbol_t sym) {
+        slab_index i = m_allocator.allocate();
+        if (i == 0)
+            return NULL;
+        slab_index l = m_leaf_allocator.allocate();
+        if (l == 0) {
+            m_allocator.release(i);
+            return NULL;
+        }
+        TrieNode *ctx = new(node(i)) TrieNode(value);
+        ctx->m_leaves = l;
+        new(leaf(l)) TrieLeaf(sym);
+        ctx->m_count = 2;       // both escape and symbol
+        ctx->m_escape = 1;
+
+        add_child(parent, i);
+        return ctx;
+    }
+
+    // Give ctx, a context without leaves, the counts of bctx, a
+    // context of the base trie. Return false if the budget does not
+    // allow them.
+    bool copy_counts(TrieNode *ctx, const TrieNode *bctx) {
+        if (bctx->m_flags & TrieNode::Dense_leaves) {
+            slab_index t = m_leaf_table_allocator.allocate();
+            if (t == 0)
+                return false;
+            memcpy(m_leaf_table_allocator.get(t), m_base->leaf_table(bctx),
+                   sizeof(TrieLeafTable));
+            ctx->m_leaves = t;
+            ctx->m_flags |= TrieNode::Dense_leaves;
+        } else {
+            // In the same order, so that coding does not change
+            slab_index *link = &ctx->m_leaves;
+            for (slab_index b = bctx->m_leaves; b != 0; ) {
+                const TrieLeaf *bl = m_base->leaf(b);
+                *link = m_leaf_allocator.allocate();
+                if (*link == 0) {
+                    release_leaves(ctx->m_leaves);
+                    ctx->m_leaves = 0;
+                    return false;
+                }
+                new(leaf(*link)) TrieLeaf(bl->m_value);
+                leaf(*link)->m_count = bl->m_count;
+                link = &leaf(*link)->m_sibling;
+                b = bl->m_sibling;
             }
+        }
+        ctx->m_count = bctx->m_count;
+        ctx->m_escape = bctx->m_escape;
+        return true;
+    }
+
+    // Add a copy of bctx, a context of the base trie, as child of
+    // parent, with the same counts and no children. Return NULL
+    // if the budget does not allow it.
+    TrieNode *shadow_node(TrieNode *parent, const TrieNode *bctx) {
+        slab_index i = m_allocator.allocate();
+        if (i == 0)
+            return NULL;
+        TrieNode *ctx = new(node(i)) TrieNode(bctx->m_value);
+        if (!copy_counts(ctx, bctx)) {
+            m_allocator.release(i);
+            return NULL;
+        }
+        ctx->m_flags |= TrieNode::Shadow;
+        ++m_shadows;
+
+        add_child(parent, i);
+        return ctx;
+    }
+
+    // Copy the contexts of the vine that are in the base only,
+    // from order 1 up, so that update_model changes none of the
+    // base. The order-0 context is copied by overlay. Return the
+    // longest order copied, less than m_cache_order if the budget
+    // runs out.
+    int shadow_vine() {
+        for (int order = 1; order <= m_cache_order; ++order) {
+            if (m_owner[order] == this)
+                continue;
+            TrieNode *ctx = shadow_node(m_vine[order-1], m_vine[order]);
+            if (ctx == NULL)
+                return order-1;
+            if (order == m_cache_coded && m_cache_leaf != NULL)
+                m_cache_leaf = find_leaf(ctx, m_cache_leaf->m_value);
+            m_vine[order] = ctx;
+            m_owner[order] = this;
+        }
+        return m_cache_order;
+    }
 
-            m_cache_parent = parent;
-            m_cache_child = node;
-            m_cache_buf_idx = buf.length();
-
-            if (node == NULL) {
-                // No such node, predict failed
-                // Encode the escape symbol
-                assert(cum == (code_value)(parent->m_count-parent->m_escape));
-                encoder->encode(cum, parent->m_count, parent->m_count);
-                
-                res = false;
+    // Count a symbol in a context, l is the leaf for sym in ctx
+    // or NULL if sym is not seen in ctx yet. For contexts with a
+    // leaf table, l is not used. A new symbol is not counted if
+    // the budget does not allow its leaf.
+    void add_symbol(TrieNode *ctx, TrieLeaf *l, symbol_t sym) {
+        if (ctx->m_flags & TrieNode::Dense_leaves) {
+            TrieLeafTable *table = leaf_table(ctx);
+            if (table->m_count[sym] == 0) {
+                ctx->m_escape++;
+                ctx->m_count += 2;  // both escape and symbol
             } else {
-                // Predict success
-                // Encode the symbol
-                encoder->encode(cum, cum+node->m_count, parent->m_count);
+                ctx->m_count++;
+            }
+            table->m_count[sym]++;
+            cum_freq_add(table->m_tree, sym, 1);
+        } else if (l == NULL) {
+            slab_index i = m_leaf_allocator.allocate();
+            if (i == 0)
+                return;
+            new(leaf(i)) TrieLeaf(sym, ctx->m_leaves);
+            ctx->m_leaves = i;
+
+            ctx->m_escape++;
+            ctx->m_count += 2;  // both escape and symbol
+
+            int n = 0;
+            for (; i != 0; i = leaf(i)->m_sibling)
+                ++n;
+            if (n > Dense_leaves_threshold)
+                promote_leaves(ctx);
+        } else {
+            l->m_count++;
+            ctx->m_count++;
+        }
+
+        if (ctx->m_count >= m_max_frequency) {
+            scale_frequency(ctx);
+        }
+    }
+
+    // Walk down along buf, vine[k] is set to the order-k context
+    // and owner[k] to the trie holding it. Return the longest
+    // order found. The contexts found child by child are added
+    // to fill, the index of this trie or NULL.
+    int walk(const Buffer &buf, TrieNode **vine, const Trie **owner,
+             ContextIndex *fill) const {
+        if (m_base != NULL)
+            return walk_overlay(buf, vine, owner);
+        if (m_indexed && (fill != NULL || !m_index.empty()))
+            return walk_indexed(buf, vine, owner, fill);
 
-                res = true;
+        // The walk of a full buffer of the common orders is unrolled
+        if (buf.length() == m_order) {
+            switch (m_order) {
+            case 2: return walk_down<2>(buf, vine, owner);
+            case 3: return walk_down<3>(buf, vine, owner);
+            case 4: return walk_down<4>(buf, vine, owner);
+            case 5: return walk_down<5>(buf, vine, owner);
+            case 6: return walk_down<6>(buf, vine, owner);
+            case 7: return walk_down<7>(buf, vine, owner);
+            case 8: return walk_down<8>(buf, vine, owner);
             }
+        }
+        return walk_down<0>(buf, vine, owner);
+    }
+
+    // As walk, in this trie only. Length is that of buf if it is
+    // known at compile time, 0 otherwise.
+    template<int Length>
+    int walk_down(const Buffer &buf, TrieNode **vine, const Trie **owner) const {
+        TrieNode *parent = node(m_root);
+        int order = 0;
 
-            if (parent->m_count >= Max_frequency) {
-                scale_frequency(parent);
+        vine[0] = parent;
+        owner[0] = this;
+        int length = Length != 0 ? Length : buf.length();
+        for (int i = length-1; i >= 0; --i) {
+            TrieNode *child = find_child(parent, buf[i]);
+            if (child == NULL)
+                break;
+            parent = child;
+            vine[++order] = parent;
+            owner[order] = this;
+        }
+        return order;
+    }
+
+    // As walk, with one probe of the index per order up to
+    // Index_max_order. The probes do not depend on each other, so
+    // their cache misses overlap. The contexts the index does not
+    // have, and the longer ones, are found child by child.
+    int walk_indexed(const Buffer &buf, TrieNode **vine, const Trie **owner,
+                     ContextIndex *fill) const {
+        int length = buf.length();
+        int indexed = length < Index_max_order ? length : Index_max_order;
+        int probed = m_index.empty() ? 0 : indexed;
+        uint64_t key = buf.key();
+        for (int k = 3; k <= probed; ++k)
+            m_index.prefetch(key, k);
+
+        TrieNode *parent = node(m_root);
+        int order = 0;
+        vine[0] = parent;
+        owner[0] = this;
+        for (int i = length-1; i >= 0; --i) {
+            slab_index c = order < probed ? m_index.find(key, order+1) : 0;
+            if (c == 0) {
+                c = child_index(parent, buf[i]);
+                if (c == 0)
+                    break;
+                if (fill != NULL && order < indexed)
+                    fill->insert(key, order+1, c);
             }
+            parent = node(c);
+            vine[++order] = parent;
+            owner[order] = this;
+        }
+        return order;
+    }
 
-            return res;
+    // Add the contexts below ctx, an order-depth context whose
+    // symbols are key, to the index
+    void index_contexts(const TrieNode *ctx, uint64_t key, int depth) {
+        if (depth == Index_max_order)
+            return;
+        if (ctx->m_flags & TrieNode::Dense_children) {
+            const slab_index *child = child_table(ctx)->m_child;
+            for (int s = 0; s < No_of_chars; ++s) {
+                if (child[s] != 0) {
+                    uint64_t ckey = key | (uint64_t)s << 8*depth;
+                    m_index.insert(ckey, depth+1, child[s]);
+                    index_contexts(node(child[s]), ckey, depth+1);
+                }
+            }
+        } else {
+            for (slab_index i = ctx->m_child; i != 0; i = node(i)->m_sibling) {
+                uint64_t ckey = key | (uint64_t)node(i)->m_value << 8*depth;
+                m_index.insert(ckey, depth+1, i);
+                index_contexts(node(i), ckey, depth+1);
+            }
         }
     }
 
-    template<typename Adapter>
-    wsymbol_t decode(ArithmeticDecoder<Adapter> *decoder, const Buffer &buf, int offset) {
-        code_value cum;
+    // Empty the index, after contexts are released or replaced
+    void clear_index() {
+        if (m_indexed && m_base == NULL)
+            m_index.clear();
+        else
+            m_index.release();
+    }
 
-        if (m_root == NULL) {
+    // As walk, down both this trie and the base. Once a context is
+    // not in this trie, none of the longer ones is.
+    int walk_overlay(const Buffer &buf, TrieNode **vine, const Trie **owner) const {
+        TrieNode *parent = node(m_root);
+        const TrieNode *bparent = m_base->node(m_base->m_root);
+        int order = 0;
 
-            // Context not initialized yet, simply escape
-            return ESC_symbol;
+        vine[0] = parent;
+        owner[0] = this;
+
+        for (int i = buf.length()-1; i >= 0; --i) {
+            TrieNode *child = parent == NULL ? NULL : find_child(parent, buf[i]);
+            TrieNode *bchild = bparent == NULL ? NULL : m_base->find_child(bparent, buf[i]);
+            if (child == NULL && bchild == NULL)
+                break;
+            parent = child;
+            bparent = bchild;
+            ++order;
+            if (child != NULL) {
+                vine[order] = child;
+                owner[order] = this;
+            } else {
+                vine[order] = bchild;
+                owner[order] = m_base;
+            }
+        }
+        return order;
+    }
+
+    // Add the symbols of ctx to excluded
+    void exclude(const TrieNode *ctx, TrieExclusion &excluded) const {
+        if (ctx->m_flags & TrieNode::Dense_leaves) {
+            const unsigned short *count = leaf_table(ctx)->m_count;
+            for (int s = 0; s < No_of_chars; ++s)
+                excluded.m_keep[s] &= -(unsigned short)(count[s] == 0);
+            excluded.m_any = true;
         } else {
-            TrieNode *parent = m_root;
-            TrieNode *node = NULL;
-            
-            for (int i = offset; i < buf.length(); ++i) {
-                node = parent->m_child;
-
-                // Search for proper node
-                while (node != NULL &&
-                       node->m_value != buf[i])
-                    node = node->m_sibling;
-
-                if (node == NULL) {
-                    // Setup cache
-                    m_cache_parent = parent;
-                    m_cache_child = node;
-                    m_cache_buf_idx = i;
-                    
-                    // Context not match, simply skip
-                    return ESC_symbol;
-                } else {
-                    parent = node;
+            for (slab_index i = ctx->m_leaves; i != 0; i = leaf(i)->m_sibling)
+                excluded.set(leaf(i)->m_value);
+        }
+    }
+
+    // Copy the counts of a leaf table without the excluded symbols
+    // to masked, with a Fenwick tree of its own, whose cumulative
+    // frequencies are then those to code with
+    static void mask_counts(const unsigned short *count, const TrieExclusion &excluded,
+                            TrieLeafTable &masked) {
+        for (int s = 0; s < No_of_chars; ++s)
+            masked.m_count[s] = count[s] & excluded.m_keep[s];
+        cum_freq_build(masked.m_count, masked.m_tree);
+    }
+
+    // The total count of ctx without the excluded symbols. For a
+    // context with a leaf table, masked is set to its counts
+    // without them, see mask_counts.
+    code_value excluded_total(const TrieNode *ctx, const TrieExclusion &excluded,
+                              TrieLeafTable &masked) const {
+        if (ctx->m_flags & TrieNode::Dense_leaves) {
+            mask_counts(leaf_table(ctx)->m_count, excluded, masked);
+            return ctx->m_escape + cum_freq_total(masked.m_tree);
+        }
+        code_value total = ctx->m_count;
+        for (slab_index i = ctx->m_leaves; i != 0; i = leaf(i)->m_sibling)
+            if (excluded.test(leaf(i)->m_value))
+                total -= leaf(i)->m_count;
+        return total;
+    }
+
+    // As encode below, with the excluded symbols left out of the
+    // cumulative frequencies and the total. sym is never excluded,
+    // it was not in the contexts escaped from.
+    template<typename Encoder, typename Stats>
+    bool encode_excluded(Encoder *encoder, const TrieNode *ctx, wsymbol_t sym,
+                         TrieLeaf *&l, const TrieExclusion &excluded, Stats &stats) const {
+        code_value cum = 0;
+        code_value freq = 0;
+        l = NULL;
+
+        TrieLeafTable masked;
+        code_value total = excluded_total(ctx, excluded, masked);
+        if (ctx->m_flags & TrieNode::Dense_leaves) {
+            if (sym < No_of_chars) {
+                cum = cum_freq_below(masked.m_count, masked.m_tree, sym);
+                freq = masked.m_count[sym];
+            }
+            stats.table_search();
+        } else {
+            int scanned = 0;
+            for (slab_index i = ctx->m_leaves; i != 0 && freq == 0; i = l->m_sibling) {
+                l = leaf(i);
+                ++scanned;
+                if (l->m_value == sym)
+                    freq = l->m_count;
+                else if (!excluded.test(l->m_value))
+                    cum += l->m_count;
+            }
+            if (freq == 0)
+                l = NULL;
+            stats.list_search(scanned);
+        }
+
+        if (freq == 0) {
+            encoder->encode(total-ctx->m_escape, total, total);
+            return false;
+        } else {
+            encoder->encode(cum, cum+freq, total);
+            return true;
+        }
+    }
+
+    // As find_symbol below, masked are the counts of ctx without
+    // the excluded symbols if it has a leaf table, see
+    // excluded_total. cum and curr_cum are in the cumulative
+    // frequencies without them.
+    template<typename Stats>
+    wsymbol_t find_excluded(const TrieNode *ctx, const TrieLeafTable &masked,
+                            code_value cum, code_value &curr_cum, code_value &freq,
+                            TrieLeaf *&l, const TrieExclusion &excluded,
+                            Stats &stats) const {
+        wsymbol_t sym = ESC_symbol;
+        l = NULL;
+
+        if (ctx->m_flags & TrieNode::Dense_leaves) {
+            unsigned below;
+            int s = cum_freq_find(masked.m_count, masked.m_tree, cum, below);
+            curr_cum = below;
+            if (s < No_of_chars) {
+                sym = s;
+                freq = masked.m_count[s];
+            }
+            stats.table_search();
+        } else {
+            int scanned = 0;
+            for (slab_index i = ctx->m_leaves; i != 0; i = l->m_sibling) {
+                l = leaf(i);
+                ++scanned;
+                if (excluded.test(l->m_value))
+                    continue;
+                if (curr_cum+l->m_count > cum) {
+                    sym = l->m_value;
+                    freq = l->m_count;
+                    break;
                 }
+                curr_cum += l->m_count;
             }
+            if (freq == 0)
+                l = NULL;
+            stats.list_search(scanned);
+        }
+        return sym;
+    }
+
+    // The symbol whose cumulative frequencies in ctx include cum,
+    // ESC_symbol for none. curr_cum and freq are set to its range,
+    // l to its leaf in a context without a leaf table, NULL
+    // otherwise.
+    template<typename Stats>
+    wsymbol_t find_symbol(const TrieNode *ctx, code_value cum, code_value &curr_cum,
+                          code_value &freq, TrieLeaf *&l, Stats &stats) const {
+        wsymbol_t sym = ESC_symbol;
 
-            cum = decoder->get_cum_freq(parent->m_count);
-            code_value curr_cum = 0;
-            node = parent->m_child;
+        if (ctx->m_flags & TrieNode::Dense_leaves) {
+            const TrieLeafTable *table = leaf_table(ctx);
+            // Search for proper symbol
+            unsigned below;
+            int s = cum_freq_find(table->m_count, table->m_tree, cum, below);
+            curr_cum = below;
+            if (s < No_of_chars) {
+                sym = s;
+                freq = table->m_count[s];
+            }
+            l = NULL;
+            stats.table_search();
+        } else {
+            l = NULL;
+            int scanned = 0;
             // Search for proper leaf
-            while (node != NULL &&
-                   curr_cum+node->m_count <= cum) {
-                curr_cum += node->m_count;
-                node = node->m_sibling;
+            for (slab_index i = ctx->m_leaves; i != 0; i = l->m_sibling) {
+                l = leaf(i);
+                ++scanned;
+                if (curr_cum+l->m_count > cum) {
+                    sym = l->m_value;
+                    freq = l->m_count;
+                    break;
+                }
+                curr_cum += l->m_count;
             }
+            if (freq == 0)
+                l = NULL;
+            stats.list_search(scanned);
+        }
+        return sym;
+    }
 
-            m_cache_parent = parent;
-            m_cache_child = node;
-            m_cache_buf_idx = buf.length();
-            
-            if (node == NULL) {
-                // No such node, predict failed, should be an escape
-                cum = decoder->get_cum_freq(parent->m_count);
-                assert(cum >= (code_value)parent->m_count-parent->m_escape);
-                decoder->pop_symbol(parent->m_count-parent->m_escape,
-                                    parent->m_count,
-                                    parent->m_count);
-
-                return ESC_symbol;
-            } else {
-                // Predict success
-                decoder->pop_symbol(curr_cum, curr_cum+node->m_count,
-                                    parent->m_count);
-                return node->m_value;
-            }
+    // Encode sym or the escape in ctx. l is set to the leaf of sym
+    // in a context without a leaf table, NULL otherwise. EOF is
+    // never seen in any context, so it is always escaped.
+    template<typename Encoder, typename Stats>
+    bool encode(Encoder *encoder, const TrieNode *ctx, wsymbol_t sym, TrieLeaf *&l,
+                Stats &stats) const {
+        code_value cum = 0;
+        code_value freq = 0;
 
-            if (parent->m_count >= Max_frequency) {
-                scale_frequency(parent);
+        if (ctx->m_count == 0) {
+            // Only the order-0 context of a new trie is empty, it
+            // escapes without coding
+            l = NULL;
+            return false;
+        } else if (sym >= No_of_chars) {
+            l = NULL;
+        } else if (ctx->m_flags & TrieNode::Dense_leaves) {
+            const TrieLeafTable *table = leaf_table(ctx);
+            cum = cum_freq_below(table->m_count, table->m_tree, sym);
+            freq = table->m_count[sym];
+            l = NULL;
+            stats.table_search();
+        } else {
+            l = NULL;
+            int scanned = 0;
+            // Search for proper leaf
+            for (slab_index i = ctx->m_leaves; i != 0; i = l->m_sibling) {
+                l = leaf(i);
+                ++scanned;
+                if (l->m_value == sym) {
+                    freq = l->m_count;
+                    break;
+                }
+                cum += l->m_count;
             }
+            if (freq == 0)
+                l = NULL;
+            stats.list_search(scanned);
+        }
+
+        if (freq == 0) {
+            // No such leaf, predict failed
+            // Encode the escape symbol
+            encoder->encode(ctx->m_count-ctx->m_escape, ctx->m_count, ctx->m_count);
+            return false;
+        } else {
+            // Predict success
+            // Encode the symbol
+            encoder->encode(cum, cum+freq, ctx->m_count);
+            return true;
         }
     }
 
-    // Update the model, when some symbol is decoded, update
-    // the related model
-    void update_model(const Buffer &buf, int offset, symbol_t sym) {
-        TrieNode *parent = NULL;
-        TrieNode *node = NULL;
-        if (m_cache_parent == NULL) {
-            // Invalid cache
-            if (m_root == NULL) {
-                m_root = new(m_allocator.allocate()) TrieNode(0, create_node(buf, offset, sym));
-            } else {
-                parent = m_root;
-                
-                for (int i = offset; i < buf.length(); ++i) {
-                    node = parent->m_child;
-
-                    while (node != NULL &&
-                           node->m_value != buf[i])
-                        node = node->m_sibling;
-
-                    if (node == NULL) {
-                        node = create_node(buf, i, sym);
-
-                        node->m_sibling = parent->m_child;
-                        parent->m_child = node;
-                        return;
-                    } else {
-                        parent = node;
-                    }
-                }
+    void release_leaves(slab_index i) {
+        while (i != 0) {
+            slab_index next = leaf(i)->m_sibling;
+            m_leaf_allocator.release(i);
+            i = next;
+        }
+    }
 
-                node = parent->m_child;
-                while (node != NULL &&
-                       node->m_value != sym)
-                    node = node->m_sibling;
+    // Release ctx with all its leaves and longer contexts
+    void release_node(slab_index i) {
+        TrieNode *ctx = node(i);
+        if (ctx->m_flags & TrieNode::Dense_leaves)
+            m_leaf_table_allocator.release(ctx->m_leaves);
+        else
+            release_leaves(ctx->m_leaves);
 
-                if (node == NULL) {
-                    node = new(m_allocator.allocate()) TrieNode(sym);
-                    node->m_sibling = parent->m_child;
-                    parent->m_child = node;
+        if (ctx->m_flags & TrieNode::Dense_children) {
+            const slab_index *child = child_table(ctx)->m_child;
+            for (int s = 0; s < No_of_chars; ++s)
+                if (child[s] != 0)
+                    release_node(child[s]);
+            m_child_table_allocator.release(ctx->m_child);
+        } else {
+            for (slab_index c = ctx->m_child; c != 0; ) {
+                slab_index next = node(c)->m_sibling;
+                release_node(c);
+                c = next;
+            }
+        }
+        if (ctx->m_flags & TrieNode::Shadow)
+            --m_shadows;
+        m_allocator.release(i);
+        ++m_reclaimed;
+    }
 
-                    parent->m_escape++;
-                    parent->m_count += 2; // both escape and symbol
+    // Release the contexts of at least Prune_min_order below ctx,
+    // an order-depth context, whose count is at most max_count.
+    // Return the number of such contexts kept.
+    size_t prune(TrieNode *ctx, int depth, int max_count) {
+        size_t kept = 0;
+        if (ctx->m_flags & TrieNode::Dense_children) {
+            slab_index *child = child_table(ctx)->m_child;
+            for (int s = 0; s < No_of_chars; ++s) {
+                if (child[s] == 0)
+                    continue;
+                if (depth+1 < Prune_min_order) {
+                    kept += prune(node(child[s]), depth+1, max_count);
+                } else if (node(child[s])->m_count <= max_count) {
+                    release_node(child[s]);
+                    child[s] = 0;
+                } else {
+                    kept += 1 + prune(node(child[s]), depth+1, max_count);
+                }
+            }
+        } else {
+            slab_index *link = &ctx->m_child;
+            while (*link != 0) {
+                TrieNode *c = node(*link);
+                if (depth+1 < Prune_min_order) {
+                    kept += prune(c, depth+1, max_count);
+                } else if (c->m_count <= max_count) {
+                    slab_index i = *link;
+                    *link = c->m_sibling;
+                    release_node(i);
+                    continue;
                 } else {
-                    node->m_count++;
-                    parent->m_count++;
+                    kept += 1 + prune(c, depth+1, max_count);
                 }
+                link = &c->m_sibling;
+            }
+        }
+        return kept;
+    }
+
+    // Called when the budget is exhausted. A restart drops all the
+    // contexts of Prune_min_order and above. Otherwise the contexts
+    // seen least are pruned, with a higher count bound each round
+    // until at least 1/Prune_fraction of the contexts are gone.
+    void reclaim() {
+        size_t contexts = m_allocator.count();
+        ++m_reclaims;
+
+        if (m_reclaim_policy == Restart) {
+            prune(node(m_root), 0, m_max_frequency);
+        } else {
+            int max_count = 2;
+            while (m_allocator.count() > contexts - contexts/Prune_fraction &&
+                   prune(node(m_root), 0, max_count) > 0) {
+                max_count *= 2;
             }
+        }
+        m_budget.exhausted = false;
+        m_cache_valid = false;
+        clear_index();
+    }
+
+    // Add n to the count of sym in ctx, return false if sym is
+    // new to ctx and the budget does not allow its leaf. Unlike
+    // add_symbol there is no rescaling and no promotion.
+    bool add_count(TrieNode *ctx, symbol_t sym, int n, bool &added) {
+        unsigned short *count;
+        if (ctx->m_flags & TrieNode::Dense_leaves) {
+            TrieLeafTable *table = leaf_table(ctx);
+            count = &table->m_count[sym];
+            added = *count == 0;
+            cum_freq_add(table->m_tree, sym, n);
         } else {
-            parent = m_cache_parent;
+            // New leaves go last, so a copied list keeps its order
+            slab_index *link = &ctx->m_leaves;
+            while (*link != 0 && leaf(*link)->m_value != sym)
+                link = &leaf(*link)->m_sibling;
+            added = *link == 0;
+            if (added) {
+                *link = m_leaf_allocator.allocate();
+                if (*link == 0)
+                    return false;
+                new(leaf(*link)) TrieLeaf(sym);
+                leaf(*link)->m_count = 0;
+            }
+            count = &leaf(*link)->m_count;
+        }
+        *count += n;
+        ctx->m_count += n;
+        return true;
+    }
 
-            if (m_cache_buf_idx == buf.length()) {
-                if (m_cache_child == NULL) {
-                    node = new(m_allocator.allocate()) TrieNode(sym);
-                    node->m_sibling = m_cache_parent->m_child;
-                    m_cache_parent->m_child = node;
+    // Add the counts of octx, a context of other, to ctx. A fresh
+    // ctx takes the escapes of octx, otherwise every symbol new
+    // to ctx counts as one escape, as in add_symbol. If the sum
+    // would reach the max frequency, ctx is rescaled first and
+    // the counts of octx are scaled the same way.
+    void merge_node(TrieNode *ctx, const Trie &other, const TrieNode *octx,
+                    bool fresh) {
+        int scale = 1;
+        if (fresh) {
+            ctx->m_escape = octx->m_escape;
+            ctx->m_count = octx->m_escape;
+        } else if (ctx->m_count + octx->m_count >= m_max_frequency) {
+            scale_frequency(ctx);
+            scale = Rescale_factor;
+        }
 
-                    m_cache_parent->m_escape++;
-                    m_cache_parent->m_count += 2;
-                } else {
-                    m_cache_child->m_count++;
-                    m_cache_parent->m_count++;
+        bool added;
+        if (octx->m_flags & TrieNode::Dense_leaves) {
+            const unsigned short *count = other.leaf_table(octx)->m_count;
+            for (int s = 0; s < No_of_chars; ++s) {
+                if (count[s] != 0 &&
+                    add_count(ctx, s, (count[s]+scale-1)/scale, added) &&
+                    added && !fresh) {
+                    ctx->m_escape++;
+                    ctx->m_count++;
                 }
-            } else {
-                node = create_node(buf, m_cache_buf_idx, sym);
-                node->m_sibling = m_cache_parent->m_child;
-                m_cache_parent->m_child = node;
+            }
+        } else {
+            for (slab_index i = octx->m_leaves; i != 0; ) {
+                const TrieLeaf *l = other.leaf(i);
+                if (add_count(ctx, l->m_value, (l->m_count+scale-1)/scale, added) &&
+                    added && !fresh) {
+                    ctx->m_escape++;
+                    ctx->m_count++;
+                }
+                i = l->m_sibling;
+            }
+        }
+
+        if (!(ctx->m_flags & TrieNode::Dense_leaves)) {
+            int n = 0;
+            for (slab_index i = ctx->m_leaves; i != 0; i = leaf(i)->m_sibling)
+                ++n;
+            if (n > Dense_leaves_threshold)
+                promote_leaves(ctx);
+        }
+        if (ctx->m_count >= m_max_frequency)
+            scale_frequency(ctx);
+
+        if (octx->m_flags & TrieNode::Dense_children) {
+            const slab_index *child = other.child_table(octx)->m_child;
+            for (int s = 0; s < No_of_chars; ++s)
+                if (child[s] != 0)
+                    merge_child(ctx, other, other.node(child[s]));
+        } else {
+            for (slab_index i = octx->m_child; i != 0; i = other.node(i)->m_sibling)
+                merge_child(ctx, other, other.node(i));
+        }
+    }
+
+    // Merge ochild into the matching child of parent, which is
+    // created if needed. Skip it if the budget does not allow.
+    void merge_child(TrieNode *parent, const Trie &other, const TrieNode *ochild) {
+        TrieNode *child = find_child(parent, ochild->m_value);
+        if (child != NULL) {
+            merge_node(child, other, ochild, false);
+        } else {
+            slab_index i = m_allocator.allocate();
+            if (i == 0)
+                return;
+            child = new(node(i)) TrieNode(ochild->m_value);
+            add_child(parent, i);
+            merge_node(child, other, ochild, true);
+        }
+    }
+
+    // Drop all the objects and blocks, leaving no root
+    void clear() {
+        m_allocator.reset();
+        m_leaf_allocator.reset();
+        m_leaf_table_allocator.reset();
+        m_child_table_allocator.reset();
+        m_arena.reset();
+    }
+
+    // Set seen[s] for the symbols s of ctx, return how many
+    int seen_symbols(const TrieNode *ctx, bool *seen) const {
+        int n = 0;
+        if (ctx->m_flags & TrieNode::Dense_leaves) {
+            const unsigned short *count = leaf_table(ctx)->m_count;
+            for (int s = 0; s < No_of_chars; ++s) {
+                seen[s] = count[s] != 0;
+                n += seen[s];
+            }
+        } else {
+            memset(seen, 0, No_of_chars*sizeof(bool));
+            for (slab_index i = ctx->m_leaves; i != 0; i = leaf(i)->m_sibling) {
+                seen[leaf(i)->m_value] = true;
+                ++n;
             }
         }
+        return n;
+    }
+
+    // Set child[s] to the child of ctx for symbol s, NULL for none
+    // or if ctx is NULL
+    void children(const TrieNode *ctx, const TrieNode **child) const {
+        memset(child, 0, sizeof(TrieNode *)*No_of_chars);
+        if (ctx == NULL)
+            return;
+        if (ctx->m_flags & TrieNode::Dense_children) {
+            const slab_index *table = child_table(ctx)->m_child;
+            for (int s = 0; s < No_of_chars; ++s)
+                if (table[s] != 0)
+                    child[s] = node(table[s]);
+        } else {
+            for (slab_index i = ctx->m_child; i != 0; i = node(i)->m_sibling)
+                child[node(i)->m_value] = node(i);
+        }
+    }
 
-        m_cache_parent = NULL;  // Invalidate cache
+    // As count_contexts, for the union of the overlay context ctx
+    // and the base context bctx, either may be NULL
+    void count_overlay(const TrieNode *ctx, const TrieNode *bctx, int depth,
+                       TrieCensus &c) const {
+        const TrieNode *child[No_of_chars];
+        const TrieNode *bchild[No_of_chars];
+        children(ctx, child);
+        m_base->children(bctx, bchild);
 
-        if (parent && parent->m_count >= Max_frequency) {
-            scale_frequency(parent);
+        c.m_contexts[depth]++;
+        for (int s = 0; s < No_of_chars; ++s)
+            if (child[s] != NULL || bchild[s] != NULL)
+                count_overlay(child[s], bchild[s], depth+1, c);
+    }
+
+    void count_contexts(const TrieNode *ctx, int depth, TrieCensus &c) const {
+        c.m_contexts[depth]++;
+        if (ctx->m_flags & TrieNode::Dense_children) {
+            const slab_index *child = child_table(ctx)->m_child;
+            for (int s = 0; s < No_of_chars; ++s)
+                if (child[s] != 0)
+                    count_contexts(node(child[s]), depth+1, c);
+        } else {
+            for (slab_index i = ctx->m_child; i != 0; i = node(i)->m_sibling)
+                count_contexts(node(i), depth+1, c);
         }
     }
 
-    void scale_frequency(TrieNode *parent) 
+public:
+    // Reclaim policies, see set_memory_limit
+    enum {
+        Prune,                  // Release the contexts seen least
+        Restart                 // Release all the long contexts
+    };
+
+    Trie(int max_frequency=Max_frequency, int order=Default_order)
+        :m_max_frequency(max_frequency), m_order(order), m_reclaim_policy(Prune),
+         m_reclaims(0), m_reclaimed(0), m_rescales(0), m_base(NULL), m_shadows(0),
+         m_cache_valid(false), m_exclusion(Default_exclusion),
+         m_indexed(Default_context_index) {
+        m_allocator.set_budget(&m_budget);
+        m_leaf_allocator.set_budget(&m_budget);
+        m_leaf_table_allocator.set_budget(&m_budget);
+        m_child_table_allocator.set_budget(&m_budget);
+        m_allocator.set_arena(&m_arena);
+        m_leaf_allocator.set_arena(&m_arena);
+        m_leaf_table_allocator.set_arena(&m_arena);
+        m_child_table_allocator.set_arena(&m_arena);
+        m_root = m_allocator.allocate();
+        new(node(m_root)) TrieNode(0);
+        clear_index();
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Drop all contexts, as a new trie with the same max
+    /// frequency, order and memory limit. All the blocks are
+    /// freed at once, their chunks go back to the shared pool.
+    ////////////////////////////////////////////////////////////
+    void reset() {
+        clear();
+        m_root = m_allocator.allocate();
+        new(node(m_root)) TrieNode(0);
+        m_base = NULL;
+        m_shadows = 0;
+        m_cache_valid = false;
+        clear_index();
+    }
+
+    int max_frequency() const {
+        return m_max_frequency;
+    }
+
+    // Length of the longest contexts, from 1 to Max_order. The
+    // buffers passed to find_context and update_model must keep
+    // as many symbols, see Buffer::set_order.
+    int order() const {
+        return m_order;
+    }
+
+    // Number of contexts, including the empty one. Those of an
+    // overlay include the base's.
+    size_t no_of_contexts() const {
+        if (m_base != NULL)
+            return m_base->no_of_contexts() + m_allocator.count()-1 - m_shadows;
+        return m_allocator.count();
+    }
+
+    // Bytes taken by the nodes, leaves and tables, not counting
+    // the base of an overlay or the index
+    size_t memory() const {
+        return m_allocator.memory() + m_leaf_allocator.memory() +
+            m_leaf_table_allocator.memory() + m_child_table_allocator.memory();
+    }
+
+    // Bytes taken by the index, see set_context_index
+    size_t index_memory() const {
+        return m_index.memory();
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Limit the bytes taken by the blocks of the allocators to
+    /// limit, 0 for no limit. When a new context or leaf does not
+    /// fit, it is left out and once the symbol is counted, memory
+    /// is reclaimed according to policy.
+    ///
+    /// The model learns differently under a limit, a decoder must
+    /// use the same limit and policy as the encoder.
+    ///
+    /// A limit turns the context index off, as it takes memory
+    /// beyond it, see set_context_index.
+    ////////////////////////////////////////////////////////////
+    void set_memory_limit(size_t limit, int policy=Prune) {
+        m_budget.limit = limit;
+        m_reclaim_policy = policy;
+        if (limit != 0 && m_indexed)
+            set_context_index(false);
+    }
+    size_t memory_limit() const {
+        return m_budget.limit;
+    }
+    int reclaim_policy() const {
+        return m_reclaim_policy;
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Whether a symbol that escapes from a context is coded in
+    /// the shorter ones as if the symbols of that context were
+    /// not there, as it is none of them (PPMC exclusion). That
+    /// takes a little more time per escape and codes smaller.
+    /// The default is Default_exclusion, a decoder must use the
+    /// same setting as the encoder. It is kept in snapshots.
+    ////////////////////////////////////////////////////////////
+    void set_exclusion(bool exclusion) {
+        m_exclusion = exclusion;
+        m_excluded.clear();
+    }
+    bool exclusion() const {
+        return m_exclusion;
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Whether the contexts of up to Index_max_order symbols are
+    /// looked up in a ContextIndex, one probe each, before they
+    /// are searched for child by child from the root. The index
+    /// is filled with the contexts find_context has to search
+    /// for, so those seen again are found at once. Its keys are
+    /// exact, so the coding is the same either way. It takes
+    /// memory beyond the budget of set_memory_limit, up to more
+    /// than the trie, see index_memory, so setting a limit turns
+    /// it off; turning it on again after that lets it grow past
+    /// the limit. The default is Default_context_index. Overlays
+    /// have no index.
+    ////////////////////////////////////////////////////////////
+    void set_context_index(bool indexed) {
+        m_indexed = indexed;
+        clear_index();
+    }
+    bool context_index() const {
+        return m_indexed;
+    }
+
+    // Add all the contexts up to Index_max_order to the index,
+    // for a trie whose contexts are only found by the const
+    // find_context from now on, which cannot add them
+    void fill_index() {
+        if (m_indexed && m_base == NULL)
+            index_contexts(node(m_root), 0, 0);
+    }
+
+    // Times the budget ran out, and contexts released since
+    size_t reclaims() const {
+        return m_reclaims;
+    }
+    size_t reclaimed_contexts() const {
+        return m_reclaimed;
+    }
+
+    // Times a context was rescaled
+    size_t rescales() const {
+        return m_rescales;
+    }
+
+    // Whether update_model can follow the contexts found for the
+    // last symbol coded, or must find them again
+    bool cache_valid() const {
+        return m_cache_valid;
+    }
+
+    // Count the contexts of each order, and the leaves, tables and
+    // blocks. This walks the whole trie. The contexts of an overlay
+    // include the base's, the rest are its own.
+    void census(TrieCensus &c) const {
+        memset(&c, 0, sizeof(TrieCensus));
+        if (m_base != NULL)
+            count_overlay(node(m_root), m_base->node(m_base->m_root), 0, c);
+        else
+            count_contexts(node(m_root), 0, c);
+        c.m_leaves = m_leaf_allocator.count();
+        c.m_leaf_tables = m_leaf_table_allocator.count();
+        c.m_child_tables = m_child_table_allocator.count();
+        c.m_blocks[0] = m_allocator.blocks();
+        c.m_blocks[1] = m_leaf_allocator.blocks();
+        c.m_blocks[2] = m_leaf_table_allocator.blocks();
+        c.m_blocks[3] = m_child_table_allocator.blocks();
+    }
+
+    // Drop all contexts and take a copy of those of other. The
+    // memory limit is kept, the copy is not checked against it.
+    // The copy of an overlay overlays the same base.
+    void copy(const Trie &other) {
+        clear();
+        m_allocator.copy(other.m_allocator);
+        m_leaf_allocator.copy(other.m_leaf_allocator);
+        m_leaf_table_allocator.copy(other.m_leaf_table_allocator);
+        m_child_table_allocator.copy(other.m_child_table_allocator);
+        m_root = other.m_root;
+        m_max_frequency = other.m_max_frequency;
+        m_order = other.m_order;
+        m_exclusion = other.m_exclusion;
+        m_base = other.m_base;
+        m_shadows = other.m_shadows;
+        m_cache_valid = false;
+        clear_index();
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Drop all contexts and overlay base instead: the contexts
+    /// are those of base until they are updated, which copies
+    /// them into this trie. base is never modified, so any number
+    /// of overlays can share it, but it must not change or go
+    /// away while they use it. It must not be an overlay itself.
+    ///
+    /// An overlay codes as a copy of base would. Only its own
+    /// contexts are pruned when its memory budget runs out.
+    ////////////////////////////////////////////////////////////
+    void overlay(const Trie *base) {
+        assert(base->m_base == NULL);
+        clear();
+        m_root = m_allocator.allocate();
+        new(node(m_root)) TrieNode(0);
+        m_max_frequency = base->m_max_frequency;
+        m_order = base->m_order;
+        m_exclusion = base->m_exclusion;
+        m_base = base;
+        m_shadows = 0;
+        m_cache_valid = false;
+        clear_index();
+        // Always updated, the budget allows it before any limit
+        copy_counts(node(m_root), base->node(base->m_root));
+    }
+
+    // The trie this one overlays, NULL for none
+    const Trie *base() const {
+        return m_base;
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Add the counts of other to this trie, context by context.
+    ///
+    /// Contexts only in other are copied, symbols new to a context
+    /// count as escapes there. Contexts whose sum reaches the max
+    /// frequency are rescaled, so the invariants of m_count and
+    /// m_escape hold as after update_model. Neither trie may be an
+    /// overlay, and both must have the same order.
+    ////////////////////////////////////////////////////////////
+    void merge(const Trie &other) {
+        assert(m_base == NULL && other.m_base == NULL);
+        assert(m_order == other.m_order);
+        merge_node(node(m_root), other, other.node(other.m_root), false);
+        m_cache_valid = false;
+
+        if (m_budget.exhausted)
+            reclaim();
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Write a snapshot of the trie, return false on error.
+    ///
+    /// The snapshot is a TrieSnapshot header followed by the
+    /// blocks of every allocator as they are in memory, each
+    /// allocator starting at a multiple of Snapshot_alignment.
+    /// Nodes only refer to each other by index, so the blocks
+    /// are valid wherever the snapshot is mapped.
+    ///
+    /// An overlay has no snapshot of its own, dumping one fails
+    /// with errno set to EINVAL.
+    ////////////////////////////////////////////////////////////
+    bool dump(FILE *f) const {
+        if (m_base != NULL) {
+            errno = EINVAL;
+            return false;
+        }
+        TrieSnapshot h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, Snapshot_magic, sizeof(h.magic));
+        h.version = Snapshot_version;
+        h.byte_order = Snapshot_byte_order;
+        h.max_frequency = m_max_frequency;
+        h.order = m_order;
+        h.exclusion = m_exclusion;
+        h.root = m_root;
+
+        uint64_t offset = align(sizeof(h));
+        h.slabs[0] = m_allocator.header(offset);
+        offset = align(offset + m_allocator.memory());
+        h.slabs[1] = m_leaf_allocator.header(offset);
+        offset = align(offset + m_leaf_allocator.memory());
+        h.slabs[2] = m_leaf_table_allocator.header(offset);
+        offset = align(offset + m_leaf_table_allocator.memory());
+        h.slabs[3] = m_child_table_allocator.header(offset);
+
+        return fwrite(&h, sizeof(h), 1, f) == 1 &&
+            write_zeros(f, h.slabs[0].offset - sizeof(h)) &&
+            m_allocator.dump(f) &&
+            write_zeros(f, h.slabs[1].offset - h.slabs[0].offset -
+                        m_allocator.memory()) &&
+            m_leaf_allocator.dump(f) &&
+            write_zeros(f, h.slabs[2].offset - h.slabs[1].offset -
+                        m_leaf_allocator.memory()) &&
+            m_leaf_table_allocator.dump(f) &&
+            write_zeros(f, h.slabs[3].offset - h.slabs[2].offset -
+                        m_leaf_table_allocator.memory()) &&
+            m_child_table_allocator.dump(f);
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Use the snapshot of size bytes at data instead of the
+    /// current contexts. Nothing is copied, the snapshot must
+    /// stay valid as long as the trie, and must be writable if
+    /// the model is to be updated. Return false if data is not
+    /// a snapshot this trie can use, the trie must not be used
+    /// after that.
+    ////////////////////////////////////////////////////////////
+    bool map(char *data, size_t size) {
+        const TrieSnapshot *h = (const TrieSnapshot *)data;
+        if (size < sizeof(*h) ||
+            memcmp(h->magic, Snapshot_magic, sizeof(h->magic)) != 0 ||
+            h->version != Snapshot_version ||
+            h->byte_order != Snapshot_byte_order ||
+            h->order < 1 || h->order > Max_order ||
+            h->root == 0 || h->root >= h->slabs[0].next)
+            return false;
+
+        clear();
+        if (!m_allocator.map(h->slabs[0], data, size) ||
+            !m_leaf_allocator.map(h->slabs[1], data, size) ||
+            !m_leaf_table_allocator.map(h->slabs[2], data, size) ||
+            !m_child_table_allocator.map(h->slabs[3], data, size))
+            return false;
+
+        m_max_frequency = h->max_frequency;
+        m_order = h->order;
+        m_exclusion = h->exclusion != 0;
+        m_root = h->root;
+        m_base = NULL;
+        m_shadows = 0;
+        m_cache_valid = false;
+        clear_index();
+        return true;
+    }
+
+
+    ////////////////////////////////////////////////////////////
+    /// Find the longest context of buf that is in the trie.
+    ///
+    /// Return its order, 0 if even the order-1 context is not
+    /// seen yet. The contexts of order 0 up to the returned
+    /// order can then be coded in, and encode_uniform after an
+    /// escape from all of them.
+    ////////////////////////////////////////////////////////////
+    int find_context(const Buffer &buf) {
+        int order = walk(buf, m_vine, m_owner, &m_index);
+
+        // Set up cache for updating model
+        m_cache_valid = true;
+        m_cache_order = order;
+        m_cache_coded = -1;
+        m_cache_leaf = NULL;
+        if (m_excluded.m_any)
+            m_excluded.clear();
+
+        return order;
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Find the contexts of buf without touching the trie, for
+    /// coding with the const encode below. Several threads can
+    /// do so at the same time, each with its own vine.
+    ////////////////////////////////////////////////////////////
+    int find_context(const Buffer &buf, TrieVine &vine) const {
+        if (vine.m_excluded.m_any)
+            vine.m_excluded.clear();
+        return walk(buf, vine.m_ctx, vine.m_owner, NULL);
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Encode symbol in the context of the given order.
+    ///
+    /// Return true if predict successfully, false if escaped.
+    ////////////////////////////////////////////////////////////
+    template<typename Encoder, typename Stats>
+    bool encode(Encoder *encoder, int order, wsymbol_t sym, Stats &stats) {
+        TrieNode *ctx = m_vine[order];
+        const Trie *owner = m_owner[order];
+        bool res;
+        if (m_excluded.m_any)
+            res = owner->encode_excluded(encoder, ctx, sym, m_cache_leaf, m_excluded, stats);
+        else
+            res = owner->encode(encoder, ctx, sym, m_cache_leaf, stats);
+        if (!res && m_exclusion)
+            owner->exclude(ctx, m_excluded);
+        m_cache_coded = order;
+
+        if (ctx->m_count >= m_max_frequency && m_owner[order] == this) {
+            scale_frequency(ctx);
+            m_cache_valid = false;
+        }
+
+        return res;
+    }
+
+    template<typename Encoder>
+    bool encode(Encoder *encoder, int order, wsymbol_t sym) {
+        NoStats stats;
+        return encode(encoder, order, sym, stats);
+    }
+
+    // As above, in a context found by the const find_context. The
+    // trie is not modified, only the exclusions of the vine.
+    template<typename Encoder, typename Stats>
+    bool encode(Encoder *encoder, TrieVine &vine, int order, wsymbol_t sym,
+                Stats &stats) const {
+        const TrieNode *ctx = vine.m_ctx[order];
+        const Trie *owner = vine.m_owner[order];
+        TrieLeaf *l;
+        bool res;
+        if (vine.m_excluded.m_any)
+            res = owner->encode_excluded(encoder, ctx, sym, l, vine.m_excluded, stats);
+        else
+            res = owner->encode(encoder, ctx, sym, l, stats);
+        if (!res && m_exclusion)
+            owner->exclude(ctx, vine.m_excluded);
+        return res;
+    }
+    template<typename Encoder>
+    bool encode(Encoder *encoder, TrieVine &vine, int order, wsymbol_t sym) const {
+        NoStats stats;
+        return encode(encoder, vine, order, sym, stats);
+    }
+
+    template<typename Decoder>
+    wsymbol_t decode(Decoder *decoder, int order) {
+        NoStats stats;
+        return decode(decoder, order, stats);
+    }
+
+    template<typename Decoder, typename Stats>
+    wsymbol_t decode(Decoder *decoder, int order, Stats &stats) {
+        TrieNode *ctx = m_vine[order];
+        m_cache_coded = order;
+        if (ctx->m_count == 0) {
+            m_cache_leaf = NULL;
+            return ESC_symbol;
+        }
+
+        const Trie *owner = m_owner[order];
+        bool excluded = m_excluded.m_any;
+        TrieLeafTable masked;
+        code_value total = ctx->m_count;
+        if (excluded)
+            total = owner->excluded_total(ctx, m_excluded, masked);
+        code_value cum = decoder->get_cum_freq(total);
+        code_value curr_cum = 0;
+        code_value freq = 0;
+        wsymbol_t sym = excluded ?
+            owner->find_excluded(ctx, masked, cum, curr_cum, freq, m_cache_leaf,
+                                 m_excluded, stats) :
+            owner->find_symbol(ctx, cum, curr_cum, freq, m_cache_leaf, stats);
+
+        if (sym == ESC_symbol) {
+            // No such leaf, predict failed, should be an escape
+            assert(cum >= total-ctx->m_escape);
+            decoder->pop_symbol(total-ctx->m_escape, total, total);
+            if (m_exclusion)
+                owner->exclude(ctx, m_excluded);
+        } else {
+            // Predict success
+            decoder->pop_symbol(curr_cum, curr_cum+freq, total);
+        }
+        return sym;
+    }
+
+    ////////////////////////////////////////////////////////////
+    /// Encode sym in the order -1 context, once it escaped from
+    /// the order-0 one: uniformly among the symbols, EOF
+    /// included, that are not seen in the order-0 context, as
+    /// those are excluded. Const like the coding of a TrieVine.
+    ////////////////////////////////////////////////////////////
+    template<typename Encoder>
+    void encode_uniform(Encoder *encoder, wsymbol_t sym) const {
+        bool seen[No_of_chars];
+        int total = No_of_symbols - seen_symbols(node(m_root), seen);
+        int rank = 0;
+        for (int s = 0; s < sym; ++s)
+            if (!seen[s])
+                ++rank;
+        assert(sym >= No_of_chars || !seen[sym]);
+        encoder->encode(rank, rank+1, total);
+    }
+
+    template<typename Decoder>
+    wsymbol_t decode_uniform(Decoder *decoder) const {
+        bool seen[No_of_chars];
+        int total = No_of_symbols - seen_symbols(node(m_root), seen);
+        code_value rank = decoder->get_cum_freq(total);
+        decoder->pop_symbol(rank, rank+1, total);
+
+        // The rank-th symbol not seen, EOF after all the others
+        wsymbol_t sym = 0;
+        for (; sym < No_of_chars; ++sym)
+            if (!seen[sym] && rank-- == 0)
+                break;
+        return sym;
+    }
+
+    // Update the model, when some symbol is coded, update all
+    // the contexts of buf
+    void update_model(const Buffer &buf, symbol_t sym) {
+        if (!m_cache_valid) {
+            find_context(buf);
+        }
+
+        // An overlay updates copies of the base contexts
+        int owned = m_base == NULL ? m_cache_order : shadow_vine();
+
+        // Contexts longer than the longest existing one are new
+        TrieNode *ctx = owned == m_cache_order ? m_vine[owned] : NULL;
+        for (int i = buf.length()-1-m_cache_order; i >= 0 && ctx != NULL; --i)
+            ctx = create_node(ctx, buf[i], sym);
+
+        // Contexts above the coded one escaped, so sym is not seen
+        // there. The coded one has its leaf cached. The rest have
+        // not been searched yet.
+        for (int order = owned; order >= 0; --order) {
+            TrieLeaf *l;
+            ctx = m_vine[order];
+            if (order == m_cache_coded) {
+                l = m_cache_leaf;
+            } else if (m_cache_coded >= 0 && order > m_cache_coded) {
+                l = NULL;
+            } else if (ctx->m_flags & TrieNode::Dense_leaves) {
+                l = NULL;
+            } else {
+                l = find_leaf(ctx, sym);
+            }
+            add_symbol(ctx, l, sym);
+        }
+
+        m_cache_valid = false;  // Invalidate cache
+
+        if (m_budget.exhausted)
+            reclaim();
+    }
+
+    void scale_frequency(TrieNode *ctx)
     {
         int cum = 0;
-        TrieNode *node = parent->m_child;
-        TrieNode *prev = NULL;
-        while (node != NULL) {
-            if (node->m_count <= Min_frequency // Delete nodes with small frequency
-                && (cum > 0 || node->m_sibling != NULL)) // But keep at least 1 node
-            {
-                if (prev == NULL) {
-                    parent->m_child = node->m_sibling;
+        m_rescales++;
+
+        // The order-0 context keeps all its symbols, so that they
+        // stay excluded from order -1
+        int min_frequency = ctx == node(m_root) ? 0 : Min_frequency;
+
+        if (ctx->m_flags & TrieNode::Dense_leaves) {
+            unsigned short *count = leaf_table(ctx)->m_count;
+            int last = No_of_chars-1;
+            while (count[last] == 0)
+                --last;
+
+            int n = 0;
+            for (int s = 0; s <= last; ++s) {
+                if (count[s] == 0)
+                    continue;
+                if (count[s] <= min_frequency // Delete leaves with small frequency
+                    && (cum > 0 || s != last)) // But keep at least 1 leaf
+                {
+                    count[s] = 0;
                 } else {
-                    prev->m_sibling = node->m_sibling;
+                    count[s] = (count[s]+Rescale_factor-1)/Rescale_factor;
+                    cum += count[s];
+                    ++n;
+                }
+            }
+
+            cum_freq_build(count, leaf_table(ctx)->m_tree);
+            if (n < Sparse_leaves_threshold)
+                demote_leaves(ctx);
+        } else {
+            slab_index *link = &ctx->m_leaves;
+            while (*link != 0) {
+                TrieLeaf *l = leaf(*link);
+                if (l->m_count <= min_frequency // Delete leaves with small frequency
+                    && (cum > 0 || l->m_sibling != 0)) // But keep at least 1 leaf
+                {
+                    slab_index i = *link;
+                    *link = l->m_sibling;
+                    m_leaf_allocator.release(i);
+                } else {
+                    l->m_count = (l->m_count+Rescale_factor-1)/Rescale_factor;
+                    cum += l->m_count;
+                    link = &l->m_sibling;
                 }
-                m_allocator.release(node);
-            } else {
-                node->m_count = (node->m_count+Rescale_factor-1)/Rescale_factor;
-                cum += node->m_count;
-                prev = node;
             }
-            
-            node = node->m_sibling;
         }
-        parent->m_escape = (parent->m_escape+Rescale_factor-1)/Rescale_factor;
-        parent->m_count = cum + parent->m_escape;
+        ctx->m_escape = (ctx->m_escape+Rescale_factor-1)/Rescale_factor;
+        ctx->m_count = cum + ctx->m_escape;
     }
-    
+
 };
 
 #endif /* _TRIE_H_ */